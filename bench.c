@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "my_malloc_internal.h"
+
+/*
+ * Micro-benchmarks of the free list primitives of my_malloc.c
+ * Usage: bench [operations]
+ * Builds synthetic free lists in a private arena laid out like a heap (heap_meta first) and times
+ * find_best_fit, add_to_free_list, remove_from_free_list, split_block and merge_blocks in isolation,
+ * reporting nanoseconds per operation for growing list lengths. Each list is linked either in address
+ * order or shuffled; a shuffled list makes every step of a walk land somewhere else in memory, the way
+ * the free list of a long-running, fragmented heap does. operations sets the approximate number of
+ * operations (or list steps) timed per measurement.
+ */
+
+#define OPERATIONS 4000000
+
+/* Free list lengths to measure */
+static const int lengths[] = {16, 256, 4096, 65536};
+#define NUM_LENGTHS 4
+
+/* Payload sizes of the synthetic free blocks: multiples of ALIGNMENT from MIN_PAYLOAD to MAX_PAYLOAD */
+#define MIN_PAYLOAD 32
+#define MAX_PAYLOAD 1024
+/* Blocks split by split_block and merged again by merge_blocks, and the size split off */
+#define SPLIT_PAYLOAD 1024
+#define SPLIT_SIZE 256
+
+static char* base = NULL;
+static char* data = NULL;
+/* Blocks of the current layout in address order and the order they are linked or visited in */
+static block_header** blocks = NULL;
+static int* order = NULL;
+static long operations = OPERATIONS;
+
+/* Returns the current time in nanoseconds */
+double now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Sets order to 0..n-1, shuffled unless ordered is set */
+void make_order(int n, bool ordered){
+	int i;
+	for(i = 0; i < n; i++) order[i] = i;
+	if(ordered) return;
+	for(i = n - 1; i > 0; i--){
+		int j = rand() % (i + 1);
+		int swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+	}
+}
+
+/*
+ * Lays out n free blocks back to back, followed by a fence. Payloads are random between
+ * MIN_PAYLOAD and MAX_PAYLOAD, or all payload bytes if payload is not 0.
+ */
+void lay_out_blocks(int n, size_t payload){
+	block_header* block = (block_header*) data;
+	size_t prev_size = 0;
+	int i;
+	for(i = 0; i <= n; i++){
+		memset(block, 0, sizeof(block_header));
+		block->size = payload != 0 ? payload : MIN_PAYLOAD + ALIGNMENT * (size_t) (rand() % ((MAX_PAYLOAD - MIN_PAYLOAD) / ALIGNMENT + 1));
+		block->prev_size = prev_size;
+		block->kind = KIND_BLOCK;
+		block->free = TRUE;
+		if(i == 0) block->flags = BLOCK_FIRST;
+		if(i == n){
+			/* The fence stops NEXT_BLOCK() walks at the end of the layout */
+			block->size = 0;
+			block->free = FALSE;
+			block->flags = BLOCK_FENCE;
+			break;
+		}
+		blocks[i] = block;
+		prev_size = block->size;
+		block = NEXT_BLOCK(block);
+	}
+}
+
+/* Links the first n blocks into a free list in the current order and returns its head */
+heap_offset link_blocks(int n){
+	heap_offset list = NULL_OFFSET;
+	int i;
+	for(i = n - 1; i >= 0; i--) list = add_to_free_list(base, list, blocks[order[i]]);
+	return list;
+}
+
+/* Number of timed repetitions of an operation over n list elements, so that every measurement does similar work */
+long repetitions(int n){
+	long reps = operations / n;
+	return reps < 1 ? 1 : reps;
+}
+
+/* Time of one find_best_fit over a list of n blocks that holds no fit, so the whole list is walked */
+double time_find_best_fit(int n, bool ordered){
+	heap_offset list;
+	long reps = repetitions(n);
+	long r;
+	double start;
+	lay_out_blocks(n, 0);
+	make_order(n, ordered);
+	list = link_blocks(n);
+	start = now_ns();
+	for(r = 0; r < reps; r++){
+		if(find_best_fit(base, list, MAX_PAYLOAD + ALIGNMENT) != NULL) return -1;
+	}
+	return (now_ns() - start) / reps;
+}
+
+/* Time of one add_to_free_list while n blocks are pushed onto an empty list */
+double time_add_to_free_list(int n, bool ordered){
+	long reps = repetitions(n);
+	long r;
+	double elapsed = 0;
+	int i;
+	lay_out_blocks(n, 0);
+	make_order(n, ordered);
+	for(r = 0; r < reps; r++){
+		heap_offset list = NULL_OFFSET;
+		double start = now_ns();
+		for(i = 0; i < n; i++) list = add_to_free_list(base, list, blocks[order[i]]);
+		elapsed += now_ns() - start;
+	}
+	return elapsed / ((double) reps * n);
+}
+
+/* Time of one remove_from_free_list while a list of n blocks is emptied in address or shuffled order */
+double time_remove_from_free_list(int n, bool ordered){
+	long reps = repetitions(n);
+	long r;
+	double elapsed = 0;
+	int i;
+	lay_out_blocks(n, 0);
+	for(r = 0; r < reps; r++){
+		heap_offset list;
+		double start;
+		/* Linked in a fixed shuffled order, unlinked in the order under test */
+		make_order(n, FALSE);
+		list = link_blocks(n);
+		make_order(n, ordered);
+		start = now_ns();
+		for(i = 0; i < n; i++) remove_from_free_list(base, &list, blocks[order[i]]);
+		elapsed += now_ns() - start;
+		if(list != NULL_OFFSET) return -1;
+	}
+	return elapsed / ((double) reps * n);
+}
+
+/*
+ * Times of one split_block and one merge_blocks: n unlinked free blocks are split, which links the
+ * remainders into a best-fit segment, and each block is merged with its remainder again.
+ */
+void time_split_merge(int n, bool ordered, double* split_ns, double* merge_ns){
+	segment seg;
+	long reps = repetitions(n);
+	long r;
+	double split_elapsed = 0;
+	double merge_elapsed = 0;
+	int i;
+	memset(&seg, 0, sizeof(segment));
+	seg.policy = MY_HEAP_POLICY_BEST_FIT;
+	lay_out_blocks(n, SPLIT_PAYLOAD);
+	make_order(n, ordered);
+	for(r = 0; r < reps; r++){
+		double start;
+		seg.free_list = NULL_OFFSET;
+		start = now_ns();
+		for(i = 0; i < n; i++) split_block(base, &seg, blocks[order[i]], SPLIT_SIZE);
+		split_elapsed += now_ns() - start;
+		/* Unlinking the remainders is not part of either measurement */
+		for(i = 0; i < n; i++) remove_from_free_list(base, &seg.free_list, NEXT_BLOCK(blocks[i]));
+		start = now_ns();
+		for(i = 0; i < n; i++) merge_blocks(blocks[order[i]], NEXT_BLOCK(blocks[order[i]]));
+		merge_elapsed += now_ns() - start;
+	}
+	*split_ns = split_elapsed / ((double) reps * n);
+	*merge_ns = merge_elapsed / ((double) reps * n);
+}
+
+int main(int argc, char** argv){
+	int max_length = lengths[NUM_LENGTHS - 1];
+	size_t data_offset = ALIGN_UP(sizeof(heap_meta), PAGE_SIZE);
+	size_t arena_size;
+	int l;
+	int layout;
+
+	if(argc > 1) operations = atol(argv[1]);
+	if(operations <= 0){
+		fprintf(stderr, "Usage: %s [operations]\n", argv[0]);
+		return 1;
+	}
+
+	/* Room for the largest layout of maximum sized blocks and its fence */
+	arena_size = data_offset + (size_t) (max_length + 1) * (sizeof(block_header) + MAX_PAYLOAD);
+	base = (char*) calloc(1, arena_size + PAGE_SIZE);
+	blocks = (block_header**) malloc(max_length * sizeof(block_header*));
+	order = (int*) malloc(max_length * sizeof(int));
+	if(base == NULL || blocks == NULL || order == NULL){
+		fprintf(stderr, "Error: arena allocation failed\n");
+		return 1;
+	}
+	/* Offsets are relative to base, and split_block() reads the minimum split size from the heap_meta there */
+	base = (char*) ALIGN_UP((size_t) base, PAGE_SIZE);
+	((heap_meta*) base)->tuning.min_split_size = MIN_SPLIT_SIZE;
+	data = base + data_offset;
+	srand(1);
+
+	printf("=== Free List Primitive Benchmarks ===\n");
+	printf("%-22s %-9s %8s %12s %14s\n", "Primitive", "Layout", "Length", "ns/op", "ns/element");
+	for(layout = 0; layout < 2; layout++){
+		bool ordered = layout == 0;
+		const char* layout_name = ordered ? "ordered" : "shuffled";
+		for(l = 0; l < NUM_LENGTHS; l++){
+			int n = lengths[l];
+			double ns = time_find_best_fit(n, ordered);
+			printf("%-22s %-9s %8d %12.1f %14.3f\n", "find_best_fit", layout_name, n, ns, ns / n);
+		}
+		for(l = 0; l < NUM_LENGTHS; l++){
+			int n = lengths[l];
+			printf("%-22s %-9s %8d %12.2f\n", "add_to_free_list", layout_name, n, time_add_to_free_list(n, ordered));
+		}
+		for(l = 0; l < NUM_LENGTHS; l++){
+			int n = lengths[l];
+			printf("%-22s %-9s %8d %12.2f\n", "remove_from_free_list", layout_name, n, time_remove_from_free_list(n, ordered));
+		}
+		for(l = 0; l < NUM_LENGTHS; l++){
+			int n = lengths[l];
+			double split_ns;
+			double merge_ns;
+			time_split_merge(n, ordered, &split_ns, &merge_ns);
+			printf("%-22s %-9s %8d %12.2f\n", "split_block", layout_name, n, split_ns);
+			printf("%-22s %-9s %8d %12.2f\n", "merge_blocks", layout_name, n, merge_ns);
+		}
+	}
+	return 0;
+}
@@ -1,10 +1,19 @@
+#define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <string.h>
 #include <time.h>
 #include "my_malloc.h"
 
-/* Test harness for my_malloc and my_free */
+/*
+ * Test harness for my_malloc and my_free
+ * Usage: manager [policy [live [ops]]]
+ * policy (first, next, best, good, indexed, buddy or tlsf) runs the harness on a heap whose segments use
+ * that placement policy, and realtime on a MY_HEAP_REALTIME heap. live keeps up to that many allocations
+ * per thread alive to fragment the segments, and ops sets the number of allocations per thread.
+ * Besides the averages, the worst single my_heap_malloc and my_heap_free are reported in wall-clock time.
+ */
 
 #define NUM_THREADS 16
 #define OPS_PER_THREAD 100
@@ -23,6 +32,19 @@ static unsigned long large_attempts = 0;
 static unsigned long large_successes = 0;
 static unsigned long large_latency_ticks = 0;
 static unsigned long large_latency_count = 0;
+static long max_malloc_ns = 0;
+static long max_free_ns = 0;
+
+/* Heap under test, allocations kept alive per thread and allocations per thread */
+static my_heap_t* heap = NULL;
+static int live_per_thread = 0;
+static int ops_per_thread = OPS_PER_THREAD;
+
+/* Placement policies selectable from the command line */
+static const char* policy_names[] = {"best", "buddy", "indexed", "first", "next", "good", "tlsf"};
+#define NUM_POLICY_NAMES 7
+/* Selects a real-time heap instead of a policy */
+#define POLICY_REALTIME NUM_POLICY_NAMES
 
 /* Randomly pick a size with the given distribution */
 size_t choose_size(){
@@ -40,21 +62,63 @@ size_t choose_size(){
 	return 0;
 }
 
-/* Worker thread: perform OPS_PER_THREAD malloc/free cycles */
+/* Nanoseconds elapsed between two monotonic clock readings */
+long elapsed_ns(const struct timespec* t0, const struct timespec* t1){
+	return (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* Frees an allocation of the harness */
+void release(void* ptr){
+	struct timespec t0;
+	struct timespec t1;
+	long ns;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	my_heap_free(heap, ptr);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = elapsed_ns(&t0, &t1);
+	pthread_mutex_lock(&metrics_mutex);
+	total_frees++;
+	if(ns > max_free_ns) max_free_ns = ns;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+/* Worker thread: perform ops_per_thread malloc/free cycles */
 void* thread_worker(void* arg){
+	void** live = NULL;
 	int i;
-	for(i = 0; i < OPS_PER_THREAD; i++){
+	if(live_per_thread > 0){
+		live = (void**) calloc(live_per_thread, sizeof(void*));
+		if(live == NULL) return NULL;
+	}
+	for(i = 0; i < ops_per_thread; i++){
 		size_t sz = choose_size();
+		int slot = live != NULL ? rand() % live_per_thread : 0;
+		clock_t t0;
+		clock_t t1;
+		clock_t dt;
+		struct timespec w0;
+		struct timespec w1;
+		long ns;
+		void* ptr;
+		/* Replace a random live allocation so that frees and allocations interleave */
+		if(live != NULL && live[slot] != NULL){
+			release(live[slot]);
+			live[slot] = NULL;
+		}
 		/* Time the allocation via clock() */
-		clock_t t0 = clock();
-		void* ptr = my_malloc(sz);
-		clock_t t1 = clock();
+		t0 = clock();
+		clock_gettime(CLOCK_MONOTONIC, &w0);
+		ptr = my_heap_malloc(heap, sz);
+		clock_gettime(CLOCK_MONOTONIC, &w1);
+		t1 = clock();
+		ns = elapsed_ns(&w0, &w1);
 		/* Difference in clock ticks */
-		clock_t dt = t1 - t0;
+		dt = t1 - t0;
 		/* Update statistics */
 		pthread_mutex_lock(&metrics_mutex);
 		total_allocations++;
 		total_latency_ticks += (unsigned long)dt;
+		if(ns > max_malloc_ns) max_malloc_ns = ns;
 		if(sz >= ONE_KB){
 			large_attempts++;
 			if(ptr){
@@ -65,18 +129,24 @@ void* thread_worker(void* arg){
 		}
 		if(ptr) total_successes++;
 		pthread_mutex_unlock(&metrics_mutex);
-		/* Free if allocated */
+		/* Keep or free if allocated */
 		if(ptr){
-			my_free(ptr);
-			pthread_mutex_lock(&metrics_mutex);
-			total_frees++;
-			pthread_mutex_unlock(&metrics_mutex);
+			if(live != NULL) live[slot] = ptr;
+			else release(ptr);
 		}
 	}
+	if(live != NULL){
+		for(i = 0; i < live_per_thread; i++){
+			if(live[i] != NULL) release(live[i]);
+		}
+		free(live);
+	}
 	return NULL;
 }
 
-int main(void){
+int main(int argc, char** argv){
+	my_heap_config_t config;
+	int policy = -1;
 	pthread_t threads[NUM_THREADS];
 	clock_t start;
 	clock_t end;
@@ -88,6 +158,43 @@ int main(void){
 	double avg_large_latency_us;
 	int i;
 
+	if(argc > 1){
+		for(i = 0; i < NUM_POLICY_NAMES; i++){
+			if(strcmp(argv[1], policy_names[i]) == 0) policy = i;
+		}
+		if(strcmp(argv[1], "realtime") == 0) policy = POLICY_REALTIME;
+		if(policy < 0){
+			fprintf(stderr, "Usage: %s [first|next|best|good|indexed|buddy|tlsf|realtime [live [ops]]]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(argc > 2) live_per_thread = atoi(argv[2]);
+	if(argc > 3) ops_per_thread = atoi(argv[3]);
+	if(live_per_thread < 0 || ops_per_thread <= 0){
+		fprintf(stderr, "Error: invalid live or ops count\n");
+		return 1;
+	}
+
+	if(policy < 0){
+		heap = my_heap_default();
+	}else{
+		/* Every allocation goes through the placement policy under test, so bump chunks are off */
+		config = my_heap_config_default();
+		if(policy == POLICY_REALTIME){
+			config.flags |= MY_HEAP_REALTIME;
+		}else{
+			if(policy != MY_HEAP_POLICY_BUDDY) config.small_policy = policy;
+			config.medium_policy = policy;
+			config.large_policy = policy;
+		}
+		config.bump_max_size = 0;
+		heap = my_heap_create(&config);
+	}
+	if(heap == NULL){
+		fprintf(stderr, "Error: heap creation failed\n");
+		return 1;
+	}
+
 	srand((unsigned)time(NULL));
 
 	start = clock();
@@ -115,8 +222,10 @@ int main(void){
 
 	/* Print results */
 	printf("=== Test Harness Results ===\n");
+	printf("Policy: %s\n", policy < 0 ? "default" : policy == POLICY_REALTIME ? "realtime" : policy_names[policy]);
 	printf("Threads: %d\n", NUM_THREADS);
-	printf("Ops per thread: %d\n", OPS_PER_THREAD);
+	printf("Ops per thread: %d\n", ops_per_thread);
+	printf("Live allocations per thread: %d\n", live_per_thread);
 	printf("Elapsed CPU time: %.3f s\n", elapsed_s);
 	printf("Total ops (alloc+free): %lu\n", total_ops);
 	printf("Throughput: %.1f ops/s\n", throughput);
@@ -127,9 +236,12 @@ int main(void){
 	printf("Large alloc attempts: %lu\n", large_attempts);
 	printf("Large success ratio: %.2f%%\n", large_success_ratio);
 	printf("Avg large latency: %.3f µs\n", avg_large_latency_us);
+	printf("Max malloc latency: %.3f µs\n", max_malloc_ns / 1000.0);
+	printf("Max free latency: %.3f µs\n", max_free_ns / 1000.0);
 
 	/* Free pre-allocated memory */
-	free_base_memory();
+	if(policy < 0) free_base_memory();
+	else my_heap_destroy(heap);
 
 	return 0;
 }
@@ -1,323 +1,3569 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
-#include "my_malloc.h"
-
-/* Boolean definitions */
-#define TRUE 1
-#define FALSE 0
-typedef unsigned char bool;
-
-/* Number of segments */
-#define NUM_SEGMENTS 5
-#define SEG_1_TO_4_SIZE ((TOTAL_SIZE * (double) (20.0/100.0)) / (double) (NUM_SEGMENTS-1))
-#define SEG_5_SIZE ((TOTAL_SIZE * (double) (80.0/100.0)))
-
-/* Minimum split size in bytes */
-#define MIN_SPLIT_SIZE 32
-
-/* Maximum time in seconds to wait for large allocations */
-#define MAX_WAIT_TIME 0.1
-#define LARGE_SIZE 4194304
-
-/* 
- * The following structure is used to manage memory blocks.
- * It contains the size of the block, pointers to the next and previous blocks,
- * and a flag indicating whether the block is free or not.
- */
-typedef struct block_header{
-	size_t size;
-	struct block_header *next; 
-	struct block_header *prev; 
-	bool free; 
+#include <limits.h>
+#include <sched.h>
+#include "my_malloc_internal.h"
+
+/* glibc 2.35 and later register an rseq area for every thread, which holds the current CPU */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <sys/rseq.h>
+#ifdef RSEQ_SIG
+#define HAVE_RSEQ 1
+#endif
+#endif
+
+/*
+ * A registered pressure callback. Function pointers are only valid in the registering
+ * process, so callbacks live in the process-local heap handle.
+ */
+typedef struct pressure_callback{
+	my_heap_pressure_callback_t callback;
+	void* arg;
+} pressure_callback;
+
+/*
+ * Per-thread allocator state of one heap, reached through the heap's thread key.
+ * Tag accounting is first collected here without any synchronization and only published to
+ * the shared per-tag counters in batches, so tagged allocation needs no global lock.
+ */
+typedef struct thread_state{
+	long tag_delta[MY_HEAP_MAX_TAGS];
+	/* Current thread chunk: objects are bump allocated from bump up to bump_end */
+	chunk_header* chunk;
+	char* bump;
+	char* bump_end;
+	long chunk_allocated;
+	int home_segment;
+	/* Scope stack: objects are bump allocated from scope_top up to scope_end of the newest chunk */
+	scope_chunk* scope_chunk;
+	char* scope_top;
+	char* scope_end;
+	scope_frame* scope_frame;
+	/* Emptied chunk kept for the next scope, so that steady-state scopes take no segment lock */
+	scope_chunk* scope_spare;
+	struct my_heap* heap;
+	struct thread_state* next_state;
+	struct thread_state* prev_state;
+} thread_state;
+
+/*
+ * A watermark crossing detected under a lock and reported once the lock is released.
+ */
+typedef struct pressure_event{
+	int level;
 	int segment_id;
-} block_header;
+	size_t bytes_in_use;
+	size_t capacity;
+} pressure_event;
+
+/*
+ * The following structure represents an independent heap instance.
+ * It is local to the process and points at the (possibly shared) mapping
+ * which owns the base memory region and segments, so heaps never share locks or free lists.
+ */
+struct my_heap{
+	char* base_ptr;
+	heap_meta* meta;
+	segment* segments;
+	size_t mapping_size;
+	int fd;
+	bool owner;
+	bool relocated;
+	char* shm_name;
+	int current_segment;
+	int current_medium_segment;
+	pthread_mutex_t round_robin_mutex;
+	pthread_mutex_t tune_mutex;
+	pressure_callback callbacks[MAX_PRESSURE_CALLBACKS];
+	int num_callbacks;
+	pthread_mutex_t callback_mutex;
+	pthread_key_t thread_key;
+	bool has_thread_key;
+	thread_state* thread_states;
+	/* Chunks of exited threads that still have room, protected by thread_state_mutex */
+	orphan_chunk* orphans;
+	int num_orphans;
+	pthread_mutex_t thread_state_mutex;
+	/* Chunk shared by all threads for small immortal objects, carved from the top of a small segment */
+	chunk_header* immortal_chunk;
+	char* immortal_bump;
+	char* immortal_end;
+	long immortal_allocated;
+	pthread_mutex_t immortal_mutex;
+	/* Live huge blocks of this process */
+	huge_header* huge_blocks;
+	pthread_mutex_t huge_mutex;
+	/* Background maintenance thread of the creating process, woken every maintenance_interval milliseconds */
+	pthread_t maintenance_thread;
+	bool maintenance_running;
+	bool maintenance_stop;
+	unsigned long maintenance_interval;
+	pthread_mutex_t maintenance_mutex;
+	pthread_cond_t maintenance_condition;
+	/* Set instead of retuning inline when the maintenance thread runs */
+	int tune_pending;
+	/* Statistics exported by the maintenance thread every stats_interval milliseconds (stats_path NULL disables) */
+	char* stats_path;
+	unsigned long stats_interval;
+	/* Latency histograms of this process, collected only while statistics are exported */
+	unsigned long malloc_latency[LATENCY_BUCKETS + 1];
+	unsigned long malloc_latency_ns;
+	unsigned long free_latency[LATENCY_BUCKETS + 1];
+	unsigned long free_latency_ns;
+	struct my_heap* next_heap;
+};
+
+void retire_chunk(my_heap_t* heap, thread_state* state);
+void orphan_thread_chunk(my_heap_t* heap, thread_state* state);
+void release_scope_chunks(my_heap_t* heap, thread_state* state);
+void initialize_buddy_blocks(char* base, segment* seg);
+void insert_free_block(char* base, segment* seg, block_header* block);
+void tlsf_clear(char* base, segment* seg);
+void start_maintenance(my_heap_t* heap, const my_heap_config_t* config);
+void give_back_loan(my_heap_t* heap, block_header* loan);
+
+/* Allocation tag of each thread, shared by all heaps (stored as tag + 1 so that 0 means unset) */
+static pthread_key_t thread_tag_key;
+static pthread_once_t thread_tag_once = PTHREAD_ONCE_INIT;
+
+/* Default heap used by my_malloc(), my_free() and free_base_memory() */
+static my_heap_t* default_heap = NULL;
+static pthread_mutex_t default_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* List of all heaps in the process, walked by the fork handlers */
+static my_heap_t* heap_list = NULL;
+static pthread_mutex_t heap_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Initializes the mutex and condition variable of a segment.
+ * Shared and persistent heaps need PTHREAD_PROCESS_SHARED so that other processes (including
+ * forked children) can use them.
+ */
+void initialize_segment_locks(segment* seg, bool shared, bool priority_inherit){
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_condattr_init(&cond_attr);
+	/* A low priority thread holding the lock runs at the priority of the highest waiter */
+	if(priority_inherit) pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+	if(shared){
+		pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+		pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	}
+	pthread_mutex_init(&seg->lock, &mutex_attr);
+	pthread_cond_init(&seg->condition, &cond_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	pthread_condattr_destroy(&cond_attr);
+}
+
+/*
+ * Initializes the process-local mutexes of a heap. Real-time heaps give them priority inheritance
+ * like their segment locks, since allocations take some of them too.
+ */
+void initialize_heap_mutexes(my_heap_t* heap, bool priority_inherit){
+	pthread_mutexattr_t mutex_attr;
+	pthread_mutexattr_init(&mutex_attr);
+	if(priority_inherit) pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&heap->round_robin_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->tune_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->callback_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->thread_state_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->immortal_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->huge_mutex, &mutex_attr);
+	pthread_mutex_init(&heap->maintenance_mutex, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+}
+
+/*
+ * Publishes the tag accounting collected by a thread to the heap's shared per-tag counters.
+ */
+void flush_tag_deltas(my_heap_t* heap, thread_state* state){
+	int tag;
+	for(tag = 0; tag < MY_HEAP_MAX_TAGS; tag++){
+		if(state->tag_delta[tag] == 0) continue;
+		__sync_add_and_fetch(&heap->meta->tag_bytes[tag], (size_t) state->tag_delta[tag]);
+		state->tag_delta[tag] = 0;
+	}
+}
+
+/*
+ * Destructor of a heap's thread key: hands the exiting thread's chunk to the orphan pool (or retires it),
+ * publishes its accounting and frees its state.
+ */
+void release_thread_state(void* arg){
+	thread_state* state = (thread_state*) arg;
+	my_heap_t* heap = state->heap;
+	orphan_thread_chunk(heap, state);
+	release_scope_chunks(heap, state);
+	flush_tag_deltas(heap, state);
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	if(state->prev_state != NULL) state->prev_state->next_state = state->next_state;
+	else heap->thread_states = state->next_state;
+	if(state->next_state != NULL) state->next_state->prev_state = state->prev_state;
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	free(state);
+}
+
+/*
+ * Returns the calling thread's state for a heap, creating it on first use.
+ * Returns NULL if the heap has no thread key or the state cannot be allocated.
+ */
+thread_state* get_thread_state(my_heap_t* heap){
+	thread_state* state;
+	if(!heap->has_thread_key) return NULL;
+	state = (thread_state*) pthread_getspecific(heap->thread_key);
+	if(state != NULL) return state;
+	state = (thread_state*) calloc(1, sizeof(thread_state));
+	if(state == NULL) return NULL;
+	state->heap = heap;
+	/* Spread the threads' chunks over the small segments; per CPU heaps pick the segment of the CPU at each refill */
+	if(heap->meta->segment_selection == MY_HEAP_SELECT_CPU){
+		state->home_segment = -1;
+	}else{
+		pthread_mutex_lock(&heap->round_robin_mutex);
+		state->home_segment = heap->current_segment;
+		heap->current_segment = (heap->current_segment + 1) % heap->meta->num_small_segments;
+		pthread_mutex_unlock(&heap->round_robin_mutex);
+	}
+	if(pthread_setspecific(heap->thread_key, state) != 0){
+		free(state);
+		return NULL;
+	}
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	state->next_state = heap->thread_states;
+	if(heap->thread_states != NULL) heap->thread_states->prev_state = state;
+	heap->thread_states = state;
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	return state;
+}
+
+/*
+ * Accounts an allocated (or freed) block to its tag, preferably in the calling thread's state.
+ */
+void account_tag(my_heap_t* heap, int tag, size_t bytes, bool allocated){
+	thread_state* state = get_thread_state(heap);
+	long delta = allocated ? (long) bytes : -(long) bytes;
+	if(state == NULL){
+		__sync_add_and_fetch(&heap->meta->tag_bytes[tag], (size_t) delta);
+		return;
+	}
+	state->tag_delta[tag] += delta;
+	if(state->tag_delta[tag] >= TAG_FLUSH_BYTES || state->tag_delta[tag] <= -TAG_FLUSH_BYTES){
+		__sync_add_and_fetch(&heap->meta->tag_bytes[tag], (size_t) state->tag_delta[tag]);
+		state->tag_delta[tag] = 0;
+	}
+}
+
+/*
+ * Returns TRUE if allocating bytes more for a tag would exceed its quota.
+ * Other threads' unpublished accounting is not seen, so the check is exact only up to
+ * TAG_FLUSH_BYTES per thread.
+ */
+bool exceeds_tag_quota(my_heap_t* heap, int tag, size_t bytes){
+	size_t quota = heap->meta->tag_quota[tag];
+	thread_state* state;
+	long usage;
+	if(quota == 0) return FALSE;
+	state = get_thread_state(heap);
+	usage = (long) heap->meta->tag_bytes[tag] + (state != NULL ? state->tag_delta[tag] : 0);
+	return usage + (long) bytes > (long) quota;
+}
+
+void create_thread_tag_key(){
+	pthread_key_create(&thread_tag_key, NULL);
+}
+
+void my_set_thread_tag(int tag){
+	assert(tag >= 0 && tag < MY_HEAP_MAX_TAGS);
+	pthread_once(&thread_tag_once, create_thread_tag_key);
+	pthread_setspecific(thread_tag_key, (void*) (size_t) (tag + 1));
+}
+
+int my_get_thread_tag(){
+	size_t value;
+	pthread_once(&thread_tag_once, create_thread_tag_key);
+	value = (size_t) pthread_getspecific(thread_tag_key);
+	return value == 0 ? MY_HEAP_NO_TAG : (int) value - 1;
+}
+
+void my_heap_set_tag_quota(my_heap_t* heap, int tag, size_t quota){
+	assert(heap != NULL);
+	assert(tag >= 0 && tag < MY_HEAP_MAX_TAGS);
+	heap->meta->tag_quota[tag] = quota;
+}
+
+size_t my_heap_tag_usage(my_heap_t* heap, int tag){
+	thread_state* state;
+	long usage;
+	assert(heap != NULL);
+	assert(tag >= 0 && tag < MY_HEAP_MAX_TAGS);
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	usage = (long) heap->meta->tag_bytes[tag];
+	for(state = heap->thread_states; state != NULL; state = state->next_state){
+		usage += state->tag_delta[tag];
+	}
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	return usage > 0 ? (size_t) usage : 0;
+}
 
-/* 
- * The following structure represents a memory segment.
- * It contains the size of the segment, a pointer to the start of the segment,
- * a pointer to the free list of blocks, and mutex locks/conditions for thread safety.
+/*
+ * Returns TRUE if the heap's mapping is shared with other processes (including forked children),
+ * in which case its segment locks are process-shared and are left alone by the fork handlers.
+ */
+bool is_mapping_shared(my_heap_t* heap){
+	return (heap->meta->flags & (MY_HEAP_SHARED | MY_HEAP_PERSISTENT)) != 0;
+}
+
+/*
+ * Runs in the parent before fork(): acquires every process-private allocator lock so that no
+ * lock is held by another thread at the moment the address space is copied.
+ * Locks are always taken in the same order: default heap, heap list, then each heap's
+ * round robin mutex and segment locks in segment order.
+ * The segment locks of shared or file-backed mappings are skipped: the lock state lives in the
+ * mapping itself, so a lock held by a parent thread is released by that thread for both processes.
+ */
+void prepare_fork(){
+	my_heap_t* heap;
+	int i;
+	pthread_mutex_lock(&default_heap_mutex);
+	pthread_mutex_lock(&heap_list_mutex);
+	for(heap = heap_list; heap != NULL; heap = heap->next_heap){
+		pthread_mutex_lock(&heap->immortal_mutex);
+		pthread_mutex_lock(&heap->huge_mutex);
+		pthread_mutex_lock(&heap->thread_state_mutex);
+		pthread_mutex_lock(&heap->round_robin_mutex);
+		if(is_mapping_shared(heap)) continue;
+		for(i = 0; i < heap->meta->num_segments; i++){
+			pthread_mutex_lock(&((heap->segments + i)->lock));
+		}
+	}
+}
+
+/*
+ * Runs in the parent after fork(): releases the locks acquired by prepare_fork() in reverse order.
+ */
+void release_after_fork(){
+	my_heap_t* heap;
+	int i;
+	for(heap = heap_list; heap != NULL; heap = heap->next_heap){
+		if(!is_mapping_shared(heap)){
+			for(i = heap->meta->num_segments - 1; i >= 0; i--){
+				pthread_mutex_unlock(&((heap->segments + i)->lock));
+			}
+		}
+		pthread_mutex_unlock(&heap->round_robin_mutex);
+		pthread_mutex_unlock(&heap->thread_state_mutex);
+		pthread_mutex_unlock(&heap->huge_mutex);
+		pthread_mutex_unlock(&heap->immortal_mutex);
+	}
+	pthread_mutex_unlock(&heap_list_mutex);
+	pthread_mutex_unlock(&default_heap_mutex);
+}
+
+/*
+ * Runs in the child after fork(): the child only has the forking thread, so process-local
+ * locks are reinitialized. Segment locks of shared or file-backed mappings were not taken
+ * before fork() and are left as they are, since the parent shares them.
+ * The thread states of all other threads are discarded. In a private heap their chunks are retired
+ * and their unpublished tag accounting is folded in; in a shared heap those threads still exist in
+ * the parent, which keeps using their chunks and publishes their accounting. For the same reason
+ * the forking thread's own chunks stay with the parent in a shared heap.
+ */
+void reinitialize_after_fork(){
+	my_heap_t* heap;
+	int i;
+	for(heap = heap_list; heap != NULL; heap = heap->next_heap){
+		bool shared = is_mapping_shared(heap);
+		thread_state* own = heap->has_thread_key ? (thread_state*) pthread_getspecific(heap->thread_key) : NULL;
+		thread_state* state = heap->thread_states;
+		initialize_heap_mutexes(heap, (heap->meta->flags & MY_HEAP_REALTIME) != 0);
+		for(i = heap->meta->num_segments - 1; i >= 0 && !shared; i--){
+			initialize_segment_locks(heap->segments + i, FALSE, (heap->meta->flags & MY_HEAP_REALTIME) != 0);
+		}
+		/* The maintenance thread is not duplicated; the child retunes inline again */
+		heap->maintenance_running = FALSE;
+		pthread_cond_init(&heap->maintenance_condition, NULL);
+		/* Retiring a chunk may free it, so this needs the locks above to be usable */
+		while(state != NULL){
+			thread_state* next = state->next_state;
+			if(state != own){
+				if(!shared){
+					retire_chunk(heap, state);
+					release_scope_chunks(heap, state);
+					flush_tag_deltas(heap, state);
+				}
+				free(state);
+			}
+			state = next;
+		}
+		/* The parent keeps adopting the orphans and using the immortal chunk of a shared heap */
+		if(shared){
+			heap->orphans = NULL;
+			heap->num_orphans = 0;
+			heap->immortal_chunk = NULL;
+			heap->immortal_bump = NULL;
+			heap->immortal_end = NULL;
+			heap->immortal_allocated = 0;
+		}
+		heap->thread_states = own;
+		if(own != NULL){
+			own->next_state = NULL;
+			own->prev_state = NULL;
+		}
+		/* The parent's copy of the forking thread keeps bump allocating from its chunks and scope stack,
+		 * so the child starts with none; scopes opened before fork() are left to the parent */
+		if(own != NULL && shared){
+			own->chunk = NULL;
+			own->bump = NULL;
+			own->bump_end = NULL;
+			own->chunk_allocated = 0;
+			own->scope_chunk = NULL;
+			own->scope_spare = NULL;
+			own->scope_top = NULL;
+			own->scope_end = NULL;
+			own->scope_frame = NULL;
+		}
+	}
+	pthread_mutex_init(&heap_list_mutex, NULL);
+	pthread_mutex_init(&default_heap_mutex, NULL);
+}
+
+void register_fork_handlers(){
+	pthread_atfork(prepare_fork, release_after_fork, reinitialize_after_fork);
+}
+
+/*
+ * Adds a fully initialized heap to the heap list so that it is protected across fork().
+ */
+void register_heap(my_heap_t* heap){
+	pthread_once(&fork_handlers_once, register_fork_handlers);
+	pthread_mutex_lock(&heap_list_mutex);
+	heap->next_heap = heap_list;
+	heap_list = heap;
+	pthread_mutex_unlock(&heap_list_mutex);
+}
+
+/*
+ * Removes a heap from the heap list before it is destroyed.
+ */
+void unregister_heap(my_heap_t* heap){
+	my_heap_t** link;
+	pthread_mutex_lock(&heap_list_mutex);
+	for(link = &heap_list; *link != NULL; link = &(*link)->next_heap){
+		if(*link == heap){
+			*link = heap->next_heap;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&heap_list_mutex);
+}
+
+/*
+ * Forms a segment into one large free block followed by a fence block that stops coalescing.
+ * The free list of the segment then only holds that block. Buddy segments are formed into
+ * maximal power-of-two blocks instead.
  */
-typedef struct segment{
-	size_t size; 
-	void* start_ptr; 
-	block_header* free_list;
-	pthread_mutex_t lock; 
-	pthread_cond_t condition; 
-} segment;
+void initialize_segment_blocks(char* base, segment* seg, int seg_id){
+	block_header* block;
+	block_header* fence;
+	seg->bytes_in_use = 0;
+	seg->under_pressure = FALSE;
+	seg->loans = NULL_OFFSET;
+	seg->rover = NULL_OFFSET;
+	seg->activity = 0;
+	seg->maintained_activity = 0;
+	seg->purged = FALSE;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY){
+		initialize_buddy_blocks(base, seg);
+		return;
+	}
+	block = (block_header*) OFFSET_TO_PTR(base, seg->start);
+	block->size = seg->size - 2 * sizeof(block_header);
+	block->prev_size = 0;
+	block->next = NULL_OFFSET;
+	block->prev = NULL_OFFSET;
+	block->requested_size = 0;
+	block->tag = MY_HEAP_NO_TAG;
+	block->kind = KIND_BLOCK;
+	block->free = TRUE;
+	block->flags = BLOCK_FIRST;
+	block->segment_id = seg_id;
+	seg->free_list = NULL_OFFSET;
+	if(seg->policy == MY_HEAP_POLICY_TLSF) tlsf_clear(base, seg);
+	insert_free_block(base, seg, block);
+	/* The fence is a permanently allocated empty block at the end of the segment */
+	fence = NEXT_BLOCK(block);
+	fence->size = 0;
+	fence->prev_size = block->size;
+	fence->next = NULL_OFFSET;
+	fence->prev = NULL_OFFSET;
+	fence->requested_size = 0;
+	fence->tag = MY_HEAP_NO_TAG;
+	fence->kind = KIND_BLOCK;
+	fence->free = FALSE;
+	fence->flags = BLOCK_FENCE;
+	fence->segment_id = seg_id;
+}
 
-/* Base memory pointer */
-static void* base_ptr = NULL;
+/*
+ * Returns the number of small segments a heap created with config gets.
+ * Unless set explicitly, per CPU selection gets one small segment per CPU (at most MAX_SMALL_SEGMENTS).
+ */
+int small_segment_count(const my_heap_config_t* config){
+	long num_cpus;
+	if(config->num_small_segments > 0) return config->num_small_segments;
+	if(config->segment_selection != MY_HEAP_SELECT_CPU) return NUM_SMALL_SEGMENTS;
+	num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if(num_cpus > MAX_SMALL_SEGMENTS) num_cpus = MAX_SMALL_SEGMENTS;
+	if(num_cpus < 1) num_cpus = 1;
+	return (int) num_cpus;
+}
 
-/* Array of segments */
-static segment* segments = NULL;
+/*
+ * Returns the CPU the calling thread runs on, read from the thread's rseq area where the kernel
+ * keeps it up to date, or from sched_getcpu() otherwise. Returns 0 if it cannot be determined.
+ */
+int current_cpu(){
+	int cpu;
+#ifdef HAVE_RSEQ
+	if(__rseq_size > 0){
+		cpu = (int) ((volatile struct rseq*) ((char*) __builtin_thread_pointer() + __rseq_offset))->cpu_id;
+		if(cpu >= 0) return cpu;
+	}
+#endif
+	cpu = sched_getcpu();
+	return cpu >= 0 ? cpu : 0;
+}
 
-/* 
- * Initializes the memory allocator of TOTAL_SIZE bytes. 
- * Allocates TOTAL_SIZE bytes of memory and sets up NUM_SEGMENTS segments.
- * Returns an array of segments or NULL if unsuccessful. 
+/*
+ * Initializes the memory allocator inside the heap's mapping of heap->mapping_size bytes.
+ * Writes the heap metadata at the start of the mapping and sets up the small, medium and large segments.
+ * Returns an array of segments or NULL if unsuccessful.
  */
-segment* initialize_allocator(){
+segment* initialize_allocator(my_heap_t* heap, int flags, const my_heap_config_t* config){
 	int i;
 	char* allocation_iterator;
 	segment* new_segments;
-	base_ptr = malloc(TOTAL_SIZE);
-	allocation_iterator = (char*) base_ptr;
-	if(base_ptr == NULL) return NULL;
-	new_segments = (segment*) malloc(sizeof(segment) * NUM_SEGMENTS);
-	if(new_segments == NULL){
-		return NULL;
-	}
-	for(i = 0; i < NUM_SEGMENTS; i++){
+	heap_meta* meta = (heap_meta*) heap->base_ptr;
+	size_t data_size;
+	int small_policy = config->small_policy;
+	int medium_policy = config->medium_policy;
+	int large_policy = config->large_policy;
+	int num_tlsf;
+	heap_offset tlsf_tables;
+	meta->total_size = heap->mapping_size;
+	meta->flags = flags;
+	meta->num_small_segments = small_segment_count(config);
+	meta->num_medium_segments = config->tuning.medium_percent > 0 ? NUM_MEDIUM_SEGMENTS : 0;
+	meta->num_segments = meta->num_small_segments + meta->num_medium_segments + 1;
+	meta->segment_selection = config->segment_selection;
+	meta->root = NULL_OFFSET;
+	meta->base_address = (size_t) heap->base_ptr;
+	meta->clean = FALSE;
+	meta->tuning = config->tuning;
+	/* Retuning walks histograms and may block on the tune lock in the middle of an allocation */
+	meta->tune_interval = (flags & MY_HEAP_REALTIME) ? 0 : config->tune_interval;
+	meta->capacity = 0;
+	meta->bytes_in_use = 0;
+	meta->under_pressure = FALSE;
+	meta->high_watermark = config->high_watermark;
+	meta->low_watermark = config->low_watermark;
+	meta->segment_high_percent = config->segment_high_percent;
+	meta->segment_low_percent = config->segment_low_percent;
+	memset(meta->tag_bytes, 0, sizeof(meta->tag_bytes));
+	memset(meta->tag_quota, 0, sizeof(meta->tag_quota));
+	/* A restarted process could never retire the chunks of the previous one */
+	meta->bump_max_size = (flags & MY_HEAP_PERSISTENT) ? 0 : config->bump_max_size;
+	meta->bump_chunk_size = config->bump_chunk_size;
+	meta->scope_chunk_size = config->scope_chunk_size;
+	/* Other processes could not reach memory outside the heap's mapping */
+	meta->huge_size = (flags & (MY_HEAP_SHARED | MY_HEAP_PERSISTENT | MY_HEAP_REALTIME)) ? 0 : config->huge_size;
+	meta->loan_size = config->loan_size;
+	meta->good_fit_percent = config->good_fit_percent;
+	meta->segments = ALIGN_UP(sizeof(heap_meta), ALIGNMENT);
+	/* The lists of TLSF segments are reserved up front so that no metadata is ever allocated later */
+	if(flags & MY_HEAP_REALTIME) small_policy = medium_policy = large_policy = MY_HEAP_POLICY_TLSF;
+	num_tlsf = 0;
+	if(small_policy == MY_HEAP_POLICY_TLSF) num_tlsf += meta->num_small_segments;
+	if(medium_policy == MY_HEAP_POLICY_TLSF) num_tlsf += meta->num_medium_segments;
+	if(large_policy == MY_HEAP_POLICY_TLSF) num_tlsf++;
+	tlsf_tables = ALIGN_UP(meta->segments + sizeof(segment) * meta->num_segments, ALIGNMENT);
+	meta->data = ALIGN_UP(tlsf_tables + sizeof(tlsf_table) * num_tlsf, PAGE_SIZE);
+	if(meta->data >= heap->mapping_size) return NULL;
+	data_size = heap->mapping_size - meta->data;
+	new_segments = (segment*) OFFSET_TO_PTR(heap->base_ptr, meta->segments);
+	allocation_iterator = heap->base_ptr + meta->data;
+	for(i = 0; i < meta->num_segments; i++){
 		size_t segment_size;
-		segment_size = (i < NUM_SEGMENTS - 1) ? (SEG_1_TO_4_SIZE) : (SEG_5_SIZE);
-		/* First segment starts at base_ptr address. */
-		(new_segments+i)->start_ptr = (void*) (allocation_iterator);
+		if(i < meta->num_small_segments) segment_size = SMALL_SEGMENT_SIZE(data_size, meta->tuning.small_percent, meta->num_small_segments);
+		else if(i < LARGE_SEGMENT(meta)) segment_size = MEDIUM_SEGMENT_SIZE(data_size, meta->tuning.medium_percent);
+		else segment_size = LARGE_SEGMENT_SIZE(data_size, meta->tuning.small_percent, meta->tuning.medium_percent);
+		segment_size = ALIGN_DOWN(segment_size, ALIGNMENT);
+		/* First segment starts at the beginning of the data area. */
+		(new_segments+i)->start = PTR_TO_OFFSET(heap->base_ptr, allocation_iterator);
 		(new_segments+i)->size = segment_size;
+		memset((new_segments+i)->histogram_count, 0, sizeof((new_segments+i)->histogram_count));
+		memset((new_segments+i)->histogram_bytes, 0, sizeof((new_segments+i)->histogram_bytes));
+		memset((new_segments+i)->histogram_max, 0, sizeof((new_segments+i)->histogram_max));
+		(new_segments+i)->allocations_since_tune = 0;
+		(new_segments+i)->lock_acquisitions = 0;
+		(new_segments+i)->lock_contended = 0;
+		(new_segments+i)->waits = 0;
+		(new_segments+i)->wait_timeouts = 0;
+		if(i < meta->num_small_segments) (new_segments+i)->policy = small_policy;
+		else if(i < LARGE_SEGMENT(meta)) (new_segments+i)->policy = medium_policy;
+		else (new_segments+i)->policy = large_policy;
+		(new_segments+i)->tlsf = NULL_OFFSET;
+		if((new_segments+i)->policy == MY_HEAP_POLICY_TLSF){
+			(new_segments+i)->tlsf = tlsf_tables;
+			tlsf_tables += sizeof(tlsf_table);
+		}
+		meta->capacity += segment_size;
 		/* Free list is one large block initially that takes up the entire segment. */
-		(new_segments+i)->free_list = (block_header*) ((new_segments+i)->start_ptr);
-		(new_segments+i)->free_list->size = segment_size - sizeof(block_header);
-		(new_segments+i)->free_list->next = NULL;
-		(new_segments+i)->free_list->prev = NULL;
-		(new_segments+i)->free_list->free = TRUE;
-		(new_segments+i)->free_list->segment_id = i;
-		/* Initialize mutex and condition variable for each segment */
-		pthread_mutex_init(&((new_segments+i)->lock), NULL);
-		pthread_cond_init(&((new_segments+i)->condition), NULL);
+		initialize_segment_blocks(heap->base_ptr, new_segments+i, i);
+		/* Initialize mutex and condition variable for each segment; the locks of a shared or file-backed
+		 * mapping are process-shared, since a forked child uses the same memory */
+		initialize_segment_locks(new_segments+i, (flags & (MY_HEAP_SHARED | MY_HEAP_PERSISTENT)) != 0, (flags & MY_HEAP_REALTIME) != 0);
 		allocation_iterator += segment_size;
 	}
+	/* The magic is written last so that attaching processes never see a partial heap */
+	meta->magic = HEAP_MAGIC;
 	return new_segments;
 }
 
-/* 
+/*
  * Adds a block to the free list.
- * free_list: Pointer to the head of the free list to add to. 
+ * base: Start of the heap mapping that offsets are relative to.
+ * free_list: Offset of the head of the free list to add to.
  * new_block: Pointer to the block to be added.
- * Returns the new head of the free list.
+ * Returns the offset of the new head of the free list.
  */
-block_header* add_to_free_list(block_header* free_list, block_header* new_block){
+heap_offset add_to_free_list(char* base, heap_offset free_list, block_header* new_block){
 	assert(new_block != NULL);
 	assert(new_block->free == TRUE);
-	if(free_list == NULL){
-		new_block->next = NULL;
-		new_block->prev = NULL;
+	if(free_list == NULL_OFFSET){
+		new_block->next = NULL_OFFSET;
+		new_block->prev = NULL_OFFSET;
 	}else{
 		new_block->next = free_list;
-		free_list->prev = new_block;
-		new_block->prev = NULL;
+		((block_header*) OFFSET_TO_PTR(base, free_list))->prev = PTR_TO_OFFSET(base, new_block);
+		new_block->prev = NULL_OFFSET;
 	}
-	return new_block;
+	return PTR_TO_OFFSET(base, new_block);
+}
+
+/*
+ * Unlinks a block from a free list.
+ * free_list: Offset of the head of the free list, updated if the block is the head.
+ */
+void remove_from_free_list(char* base, heap_offset* free_list, block_header* block){
+	assert(block != NULL);
+	if(block->prev != NULL_OFFSET){
+		((block_header*) OFFSET_TO_PTR(base, block->prev))->next = block->next;
+	}else{
+		*free_list = block->next;
+	}
+	if(block->next != NULL_OFFSET){
+		((block_header*) OFFSET_TO_PTR(base, block->next))->prev = block->prev;
+	}
+	block->next = NULL_OFFSET;
+	block->prev = NULL_OFFSET;
 }
 
-/* 
+/*
  * Finds the smallest free block in the free list that is large enough to accommodate the requested size.
  * Returns NULL if no suitable block is found.
  */
-block_header* find_best_fit(block_header* free_list, size_t size){
+block_header* find_best_fit(char* base, heap_offset free_list, size_t size){
 	block_header* best_fit;
 	block_header* current;
 	assert(size > 0);
 	best_fit = NULL;
-	current = free_list;
+	current = (block_header*) OFFSET_TO_PTR(base, free_list);
 	while(current != NULL){
 		if(current->free && current->size >= size){
 			if(best_fit == NULL || current->size < best_fit->size){
 				best_fit = current;
 			}
 		}
-		current = current->next;
+		current = (block_header*) OFFSET_TO_PTR(base, current->next);
 	}
 
 	return best_fit;
 }
 
 /*
- * Splits a block into two smaller blocks if the remaining size is greater than or equal to MIN_SPLIT_SIZE.
- * The first block is marked as allocated and the second block is added to the free list.
+ * Finds the first free block in the free list that is large enough for the requested size.
+ * Returns NULL if no suitable block is found.
  */
-void split_block(segment* seg, block_header* block, size_t size){
-	assert(block != NULL);
-	assert(size > 0);
-	if(block->size - size >= MIN_SPLIT_SIZE + sizeof(block_header)){
-		block_header* new_block = (block_header*) ((char*) block + sizeof(block_header) + size);
-		new_block->free = TRUE;
-		new_block->size = block->size - size - sizeof(block_header);
-		new_block->next = block->next;
-		if(new_block->next != NULL) block->next->prev = new_block;
-		new_block->prev = block;
-		block->next = new_block;
-		new_block->segment_id = block->segment_id;
+block_header* find_first_fit(char* base, heap_offset free_list, size_t size){
+	block_header* current = (block_header*) OFFSET_TO_PTR(base, free_list);
+	while(current != NULL && current->size < size){
+		current = (block_header*) OFFSET_TO_PTR(base, current->next);
+	}
+	return current;
+}
 
-		/* Shrink original block */
-		block->size = size;
-		block->free = FALSE;
+/*
+ * Finds the free block at the highest address that is large enough for the requested size.
+ * Returns NULL if no suitable block is found.
+ */
+block_header* find_highest_fit(char* base, heap_offset free_list, size_t size){
+	block_header* highest_fit = NULL;
+	block_header* current = (block_header*) OFFSET_TO_PTR(base, free_list);
+	while(current != NULL){
+		if(current->size >= size && (highest_fit == NULL || current > highest_fit)) highest_fit = current;
+		current = (block_header*) OFFSET_TO_PTR(base, current->next);
+	}
+	return highest_fit;
+}
 
-		/* Unlink original block immediately */
-		if(block->prev != NULL) block->prev->next = block->next;
-		if(block->next != NULL) block->next->prev = block->prev;
-		if(seg->free_list == block){
-			seg->free_list = block->next;
+/*
+ * Finds the next free block that is large enough for the requested size, starting where the
+ * previous search of the segment stopped and wrapping around at the end of the free list.
+ * Returns NULL if no suitable block is found.
+ */
+block_header* find_next_fit(char* base, segment* seg, size_t size){
+	block_header* head = (block_header*) OFFSET_TO_PTR(base, seg->free_list);
+	block_header* start = (block_header*) OFFSET_TO_PTR(base, seg->rover);
+	block_header* current;
+	if(head == NULL) return NULL;
+	if(start == NULL) start = head;
+	current = start;
+	do{
+		if(current->size >= size){
+			seg->rover = current->next;
+			return current;
 		}
-	}
+		current = (block_header*) OFFSET_TO_PTR(base, current->next);
+		if(current == NULL) current = head;
+	}while(current != start);
+	return NULL;
 }
 
-/* 
- * Merges two adjacent free blocks into a single larger block.
+/*
+ * Finds a free block that is good enough: the first one at most tolerance bytes larger than the
+ * requested size, or else the best fit.
+ * Returns NULL if no suitable block is found.
  */
-void merge_blocks(block_header* block1, block_header* block2){
-	assert(block1 != NULL);
-	assert(block2 != NULL);
-	assert(block1->free && block2->free);
-	assert((char*) block1 + sizeof(block_header) + block1->size == (char*) block2);
-	if(block2->prev != NULL) block2->prev->next = block2->next;
-	if(block2->next != NULL) block2->next->prev = block2->prev;
-	block1->size += block2->size + sizeof(block_header);
-	block1->next = block2->next;
-	if(block2->next != NULL) block2->next->prev = block1;
+block_header* find_good_fit(char* base, heap_offset free_list, size_t size, size_t tolerance){
+	block_header* best_fit = NULL;
+	block_header* current = (block_header*) OFFSET_TO_PTR(base, free_list);
+	while(current != NULL){
+		if(current->size >= size){
+			if(current->size - size <= tolerance) return current;
+			if(best_fit == NULL || current->size < best_fit->size) best_fit = current;
+		}
+		current = (block_header*) OFFSET_TO_PTR(base, current->next);
+	}
+	return best_fit;
 }
 
-/* 
- * Handles large allocations by waiting for a free block to become available.
- * Blocks the calling thread until a suitable block is found.
- * Returns a pointer to the free block or NULL if not found.
+/*
+ * Free blocks of indexed segments form a red-black tree ordered by (size, address) instead of a list.
+ * A free block's next and prev offsets are its left and right children; its parent and colour are
+ * kept at the start of its payload, which every free block has room for.
  */
-block_header* wait_for_free_block(segment* seg, size_t size){
-	struct timespec timeout;
-	time_t start_time;
-	block_header* block = NULL;
+typedef struct tree_links{
+	heap_offset parent;
+	size_t red;
+} tree_links;
 
-	pthread_mutex_lock(&seg->lock);
-	assert(seg != NULL);
-	assert(size > 0);
-	assert(seg->free_list != NULL);
-	start_time = time(NULL);
-	timeout.tv_sec = start_time + (time_t) MAX_WAIT_TIME;
-	/* Nanoseconds not used here */
-	timeout.tv_nsec = 0;
-	while(1){
-		int rc;
-		block = find_best_fit(seg->free_list, size);
-		if(block != NULL || size > TOTAL_SIZE) break;
-		/* Wait for a free block to become available with a timeout */
-		rc = pthread_cond_timedwait(&seg->condition, &seg->lock, &timeout);
-		if(rc == ETIMEDOUT) break;
-	}
+#define TREE_LINKS(block) ((tree_links*) ((char*) (block) + sizeof(block_header)))
+#define TREE_LEFT(base, block) ((block_header*) OFFSET_TO_PTR(base, (block)->next))
+#define TREE_RIGHT(base, block) ((block_header*) OFFSET_TO_PTR(base, (block)->prev))
+#define TREE_PARENT(base, block) ((block_header*) OFFSET_TO_PTR(base, TREE_LINKS(block)->parent))
+#define TREE_IS_RED(block) ((block) != NULL && TREE_LINKS(block)->red)
 
-	if(block == NULL) pthread_mutex_unlock(&seg->lock);
+/*
+ * Returns TRUE if block1 orders before block2: smaller blocks first, lower addresses among equal sizes.
+ */
+bool tree_precedes(block_header* block1, block_header* block2){
+	return block1->size < block2->size || (block1->size == block2->size && block1 < block2);
+}
 
-	return block;
+/*
+ * Puts child in the place of block under block's parent (or at the root).
+ */
+void tree_replace_child(char* base, segment* seg, block_header* block, block_header* child){
+	block_header* parent = TREE_PARENT(base, block);
+	if(parent == NULL) seg->free_list = PTR_TO_OFFSET(base, child);
+	else if(TREE_LEFT(base, parent) == block) parent->next = PTR_TO_OFFSET(base, child);
+	else parent->prev = PTR_TO_OFFSET(base, child);
+	if(child != NULL) TREE_LINKS(child)->parent = PTR_TO_OFFSET(base, parent);
 }
 
-void* my_malloc(size_t size){
-	static int current_segment = 0;
-	static bool initialized = FALSE;
-	static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-	static pthread_mutex_t round_robin_mutex = PTHREAD_MUTEX_INITIALIZER;
-	block_header* block;
-	void* ptr;
-	int seg_id = 0;
-	size_t actual_size = size + sizeof(block_header);
-	int i;
-	assert(size > 0);
-	/* Ensure initialization only happens once by locking the mutex */
-	pthread_mutex_lock(&init_mutex);
-	if(!initialized){
-		/* Initialize the allocator */
-		segments = initialize_allocator();
-		if(segments == NULL){
-			pthread_mutex_unlock(&init_mutex);
-			pthread_mutex_destroy(&init_mutex);
-			pthread_mutex_destroy(&round_robin_mutex);
-			free(segments);
-			free(base_ptr);
-			return NULL;
+void tree_rotate_left(char* base, segment* seg, block_header* block){
+	block_header* right = TREE_RIGHT(base, block);
+	block->prev = right->next;
+	if(right->next != NULL_OFFSET) TREE_LINKS(TREE_LEFT(base, right))->parent = PTR_TO_OFFSET(base, block);
+	tree_replace_child(base, seg, block, right);
+	right->next = PTR_TO_OFFSET(base, block);
+	TREE_LINKS(block)->parent = PTR_TO_OFFSET(base, right);
+}
+
+void tree_rotate_right(char* base, segment* seg, block_header* block){
+	block_header* left = TREE_LEFT(base, block);
+	block->next = left->prev;
+	if(left->prev != NULL_OFFSET) TREE_LINKS(TREE_RIGHT(base, left))->parent = PTR_TO_OFFSET(base, block);
+	tree_replace_child(base, seg, block, left);
+	left->prev = PTR_TO_OFFSET(base, block);
+	TREE_LINKS(block)->parent = PTR_TO_OFFSET(base, left);
+}
+
+/*
+ * Inserts a free block into the tree of an indexed segment and rebalances it.
+ */
+void tree_insert(char* base, segment* seg, block_header* block){
+	block_header* parent = NULL;
+	block_header* current = (block_header*) OFFSET_TO_PTR(base, seg->free_list);
+	while(current != NULL){
+		parent = current;
+		current = tree_precedes(block, current) ? TREE_LEFT(base, current) : TREE_RIGHT(base, current);
+	}
+	block->next = NULL_OFFSET;
+	block->prev = NULL_OFFSET;
+	TREE_LINKS(block)->parent = PTR_TO_OFFSET(base, parent);
+	TREE_LINKS(block)->red = TRUE;
+	if(parent == NULL) seg->free_list = PTR_TO_OFFSET(base, block);
+	else if(tree_precedes(block, parent)) parent->next = PTR_TO_OFFSET(base, block);
+	else parent->prev = PTR_TO_OFFSET(base, block);
+	while(TREE_IS_RED(parent = TREE_PARENT(base, block))){
+		block_header* grandparent = TREE_PARENT(base, parent);
+		bool parent_is_left = TREE_LEFT(base, grandparent) == parent;
+		block_header* uncle = parent_is_left ? TREE_RIGHT(base, grandparent) : TREE_LEFT(base, grandparent);
+		if(TREE_IS_RED(uncle)){
+			TREE_LINKS(parent)->red = FALSE;
+			TREE_LINKS(uncle)->red = FALSE;
+			TREE_LINKS(grandparent)->red = TRUE;
+			block = grandparent;
+			continue;
+		}
+		if(parent_is_left){
+			if(TREE_RIGHT(base, parent) == block){
+				tree_rotate_left(base, seg, parent);
+				block = parent;
+				parent = TREE_PARENT(base, block);
+			}
+			tree_rotate_right(base, seg, grandparent);
+		}else{
+			if(TREE_LEFT(base, parent) == block){
+				tree_rotate_right(base, seg, parent);
+				block = parent;
+				parent = TREE_PARENT(base, block);
+			}
+			tree_rotate_left(base, seg, grandparent);
 		}
-		initialized = TRUE;
+		TREE_LINKS(parent)->red = FALSE;
+		TREE_LINKS(grandparent)->red = TRUE;
 	}
-	pthread_mutex_unlock(&init_mutex);
-	/* Use round robin allocation for the small segments*/
-	pthread_mutex_lock(&round_robin_mutex);
-	seg_id = current_segment;
-	current_segment = (current_segment + 1) % (NUM_SEGMENTS-1);
-	pthread_mutex_unlock(&round_robin_mutex);
+	TREE_LINKS((block_header*) OFFSET_TO_PTR(base, seg->free_list))->red = FALSE;
+}
 
-	pthread_mutex_lock(&((segments + seg_id)->lock));
-	block = find_best_fit((segments+seg_id)->free_list, actual_size);
-	if(block != NULL){
-		/* If a suitable block is found, split it and return the pointer */
-		split_block(segments + seg_id, block, size);
+/*
+ * Removes a free block from the tree of an indexed segment and rebalances it.
+ */
+void tree_remove(char* base, segment* seg, block_header* block){
+	block_header* child;
+	block_header* parent;
+	bool removed_red = TREE_LINKS(block)->red;
+	if(block->next == NULL_OFFSET || block->prev == NULL_OFFSET){
+		child = block->next == NULL_OFFSET ? TREE_RIGHT(base, block) : TREE_LEFT(base, block);
+		parent = TREE_PARENT(base, block);
+		tree_replace_child(base, seg, block, child);
 	}else{
-		/* Release the current segment lock before checking all segments */
-		pthread_mutex_unlock(&((segments + seg_id)->lock));
-		/* If no suitable block is found, wait for a free block for each segment
-		 * For large allocations, wait for the fifth segment for a free block*/
-		if(size <= LARGE_SIZE){
-			for(i = 0; i < NUM_SEGMENTS-1; i++){
-				block = wait_for_free_block(segments + i, actual_size);
-				if(block != NULL){
-					seg_id = i;
-					break;
-				}
+		/* Replace the block by its successor, the leftmost block of its right subtree */
+		block_header* successor = TREE_RIGHT(base, block);
+		while(successor->next != NULL_OFFSET) successor = TREE_LEFT(base, successor);
+		removed_red = TREE_LINKS(successor)->red;
+		child = TREE_RIGHT(base, successor);
+		if(TREE_PARENT(base, successor) == block){
+			parent = successor;
+		}else{
+			parent = TREE_PARENT(base, successor);
+			tree_replace_child(base, seg, successor, child);
+			successor->prev = block->prev;
+			TREE_LINKS(TREE_RIGHT(base, successor))->parent = PTR_TO_OFFSET(base, successor);
+		}
+		tree_replace_child(base, seg, block, successor);
+		successor->next = block->next;
+		TREE_LINKS(TREE_LEFT(base, successor))->parent = PTR_TO_OFFSET(base, successor);
+		TREE_LINKS(successor)->red = TREE_LINKS(block)->red;
+	}
+	block->next = NULL_OFFSET;
+	block->prev = NULL_OFFSET;
+	if(removed_red) return;
+	/* A black block was removed: child carries an extra black that is pushed up or resolved */
+	while(parent != NULL && !TREE_IS_RED(child)){
+		bool child_is_left = TREE_LEFT(base, parent) == child;
+		block_header* sibling = child_is_left ? TREE_RIGHT(base, parent) : TREE_LEFT(base, parent);
+		if(TREE_IS_RED(sibling)){
+			TREE_LINKS(sibling)->red = FALSE;
+			TREE_LINKS(parent)->red = TRUE;
+			if(child_is_left) tree_rotate_left(base, seg, parent);
+			else tree_rotate_right(base, seg, parent);
+			sibling = child_is_left ? TREE_RIGHT(base, parent) : TREE_LEFT(base, parent);
+		}
+		if(!TREE_IS_RED(TREE_LEFT(base, sibling)) && !TREE_IS_RED(TREE_RIGHT(base, sibling))){
+			TREE_LINKS(sibling)->red = TRUE;
+			child = parent;
+			parent = TREE_PARENT(base, child);
+			continue;
+		}
+		if(child_is_left){
+			if(!TREE_IS_RED(TREE_RIGHT(base, sibling))){
+				TREE_LINKS(TREE_LEFT(base, sibling))->red = FALSE;
+				TREE_LINKS(sibling)->red = TRUE;
+				tree_rotate_right(base, seg, sibling);
+				sibling = TREE_RIGHT(base, parent);
 			}
+			TREE_LINKS(TREE_RIGHT(base, sibling))->red = FALSE;
+			TREE_LINKS(sibling)->red = TREE_LINKS(parent)->red;
+			TREE_LINKS(parent)->red = FALSE;
+			tree_rotate_left(base, seg, parent);
 		}else{
-			block = wait_for_free_block(segments + NUM_SEGMENTS-1, actual_size);
-			if(block != NULL){
-				seg_id = NUM_SEGMENTS-1;
+			if(!TREE_IS_RED(TREE_LEFT(base, sibling))){
+				TREE_LINKS(TREE_RIGHT(base, sibling))->red = FALSE;
+				TREE_LINKS(sibling)->red = TRUE;
+				tree_rotate_left(base, seg, sibling);
+				sibling = TREE_LEFT(base, parent);
 			}
+			TREE_LINKS(TREE_LEFT(base, sibling))->red = FALSE;
+			TREE_LINKS(sibling)->red = TREE_LINKS(parent)->red;
+			TREE_LINKS(parent)->red = FALSE;
+			tree_rotate_right(base, seg, parent);
 		}
-		if(block == NULL){
-			return NULL;
+		child = (block_header*) OFFSET_TO_PTR(base, seg->free_list);
+		break;
+	}
+	if(child != NULL) TREE_LINKS(child)->red = FALSE;
+}
+
+/*
+ * Finds the best fit in the tree of an indexed segment in O(log n): the smallest free block large
+ * enough for the requested size, and the lowest addressed one among blocks of that size.
+ * Returns NULL if no suitable block is found.
+ */
+block_header* tree_find_best_fit(char* base, segment* seg, size_t size){
+	block_header* best_fit = NULL;
+	block_header* current = (block_header*) OFFSET_TO_PTR(base, seg->free_list);
+	while(current != NULL){
+		if(current->size >= size){
+			best_fit = current;
+			current = TREE_LEFT(base, current);
+		}else{
+			current = TREE_RIGHT(base, current);
 		}
-		block->segment_id = seg_id;
-		/* After finding a free block, split it */
-		split_block(segments + seg_id, block, size);
 	}
-	/* Mark the block as allocated */
-	ptr = (void*) ((char*) block + sizeof(block_header));
-	block->free = FALSE;
-	pthread_mutex_unlock(&((segments + seg_id)->lock));
-	/* Return the pointer to the allocated memory */
-	return ptr;
+	return best_fit;
 }
 
-void my_free(void* ptr){
-	segment* seg;
-	int seg_id;
-	block_header* hdr;
-	if (ptr == NULL) return;
-    	hdr = (block_header*) ((char*) ptr - sizeof(block_header));
-	/* Must be stored in the header */
-    	seg_id = hdr->segment_id;  
-	seg = segments + seg_id;
-    	pthread_mutex_lock(&seg->lock);
-    	hdr->free = TRUE;
-    	/* Coalesce with prev */
-    	if (hdr->prev && hdr->prev->free && (char*) hdr->prev + sizeof(block_header) + hdr->prev->size == (char*) hdr) {
-        	merge_blocks(hdr->prev, hdr);
-        	hdr = hdr->prev;
-    	}
-    	/* Coalesce with next */
-    	if (hdr->next && hdr->next->free && (char*) hdr + sizeof(block_header) + hdr->size == (char*) hdr->next){
-        	merge_blocks(hdr, hdr->next);
-    	}
-
-    	pthread_cond_broadcast(&seg->condition);
-    	pthread_mutex_unlock(&seg->lock);
-}
-
-/* 
- * Frees base memory and destroys all segments, mutexes, and condition variables.
+/*
+ * Returns the index of the highest set bit of n (n > 0).
  */
-void free_base_memory(){
-	int i;
-	for(i = 0; i < NUM_SEGMENTS; i++){
-		pthread_mutex_destroy(&((segments + i)->lock));
-		pthread_cond_destroy(&((segments + i)->condition));
+int floor_log2(size_t n){
+	return (int) (sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long) n);
+}
+
+/*
+ * Maps a block size to its TLSF list: the power of two range (fl) and the subdivision of it (sl).
+ * Sizes beyond the last range share its last list.
+ */
+void tlsf_mapping(size_t size, int* fl, int* sl){
+	int log2;
+	if(size < ((size_t) 1 << TLSF_LINEAR_SHIFT)){
+		*fl = 0;
+		*sl = (int) (size >> (TLSF_LINEAR_SHIFT - TLSF_SL_SHIFT));
+		return;
 	}
-	free(segments);
-	free(base_ptr);
+	log2 = floor_log2(size);
+	*fl = log2 - TLSF_LINEAR_SHIFT + 1;
+	*sl = (int) (size >> (log2 - TLSF_SL_SHIFT)) & (TLSF_SL_COUNT - 1);
+	if(*fl >= TLSF_FL_COUNT){
+		*fl = TLSF_FL_COUNT - 1;
+		*sl = TLSF_SL_COUNT - 1;
+	}
+}
+
+/*
+ * Empties the lists of a TLSF segment.
+ */
+void tlsf_clear(char* base, segment* seg){
+	tlsf_table* table = (tlsf_table*) OFFSET_TO_PTR(base, seg->tlsf);
+	int fl;
+	int sl;
+	table->fl_bitmap = 0;
+	for(fl = 0; fl < TLSF_FL_COUNT; fl++){
+		table->sl_bitmap[fl] = 0;
+		for(sl = 0; sl < TLSF_SL_COUNT; sl++) table->heads[fl][sl] = NULL_OFFSET;
+	}
+}
+
+void tlsf_insert(char* base, segment* seg, block_header* block){
+	tlsf_table* table = (tlsf_table*) OFFSET_TO_PTR(base, seg->tlsf);
+	int fl;
+	int sl;
+	tlsf_mapping(block->size, &fl, &sl);
+	table->heads[fl][sl] = add_to_free_list(base, table->heads[fl][sl], block);
+	table->sl_bitmap[fl] |= 1U << sl;
+	table->fl_bitmap |= 1U << fl;
+}
+
+void tlsf_remove(char* base, segment* seg, block_header* block){
+	tlsf_table* table = (tlsf_table*) OFFSET_TO_PTR(base, seg->tlsf);
+	int fl;
+	int sl;
+	tlsf_mapping(block->size, &fl, &sl);
+	remove_from_free_list(base, &table->heads[fl][sl], block);
+	if(table->heads[fl][sl] == NULL_OFFSET){
+		table->sl_bitmap[fl] &= ~(1U << sl);
+		if(table->sl_bitmap[fl] == 0) table->fl_bitmap &= ~(1U << fl);
+	}
+}
+
+/*
+ * Rounds a request up to the next TLSF list boundary, the smallest size whose list holds only
+ * blocks of at least size bytes.
+ */
+size_t tlsf_round(size_t size){
+	if(size < ((size_t) 1 << TLSF_LINEAR_SHIFT)) return size;
+	return size + ((size_t) 1 << (floor_log2(size) - TLSF_SL_SHIFT)) - 1;
+}
+
+/*
+ * Finds a free block of at least size bytes in constant time. The request is rounded up to the
+ * next list boundary, so that the head of any non-empty list from there on fits without a scan
+ * (at the price of skipping the blocks of the request's own list that would have fit).
+ * Returns NULL if no suitable block is found.
+ */
+block_header* tlsf_find(char* base, segment* seg, size_t size){
+	tlsf_table* table = (tlsf_table*) OFFSET_TO_PTR(base, seg->tlsf);
+	block_header* block;
+	unsigned int bits;
+	int fl;
+	int sl;
+	tlsf_mapping(tlsf_round(size), &fl, &sl);
+	bits = table->sl_bitmap[fl] & (~0U << sl);
+	if(bits == 0){
+		bits = fl + 1 < TLSF_FL_COUNT ? table->fl_bitmap & (~0U << (fl + 1)) : 0;
+		if(bits == 0) return NULL;
+		fl = __builtin_ctz(bits);
+		bits = table->sl_bitmap[fl];
+	}
+	block = (block_header*) OFFSET_TO_PTR(base, table->heads[fl][__builtin_ctz(bits)]);
+	/* Only the shared last list can hold blocks smaller than the request */
+	return block->size >= size ? block : NULL;
+}
+
+/*
+ * Adds a free block to the free list or tree of a segment.
+ */
+void insert_free_block(char* base, segment* seg, block_header* block){
+	if(seg->policy == MY_HEAP_POLICY_INDEXED) tree_insert(base, seg, block);
+	else if(seg->policy == MY_HEAP_POLICY_TLSF) tlsf_insert(base, seg, block);
+	else seg->free_list = add_to_free_list(base, seg->free_list, block);
+}
+
+/*
+ * Removes a free block from the free list or tree of a segment.
+ */
+void unlink_free_block(char* base, segment* seg, block_header* block){
+	if(seg->policy == MY_HEAP_POLICY_INDEXED){
+		tree_remove(base, seg, block);
+		return;
+	}
+	if(seg->policy == MY_HEAP_POLICY_TLSF){
+		tlsf_remove(base, seg, block);
+		return;
+	}
+	/* The next search of a next fit segment continues after the removed block */
+	if(seg->rover == PTR_TO_OFFSET(base, block)) seg->rover = block->next;
+	remove_from_free_list(base, &seg->free_list, block);
+}
+
+/*
+ * Splits a block into two smaller blocks if the remaining size is greater than or equal to the heap's minimum split size.
+ * The block must already be unlinked from the free list; the remainder is added to the free list or tree.
+ */
+void split_block(char* base, segment* seg, block_header* block, size_t size){
+	assert(block != NULL);
+	assert(size > 0);
+	if(block->size - size >= ((heap_meta*) base)->tuning.min_split_size + sizeof(block_header)){
+		block_header* new_block = (block_header*) ((char*) block + sizeof(block_header) + size);
+		new_block->free = TRUE;
+		new_block->flags = 0;
+		new_block->requested_size = 0;
+		new_block->tag = MY_HEAP_NO_TAG;
+		new_block->kind = KIND_BLOCK;
+		new_block->size = block->size - size - sizeof(block_header);
+		new_block->prev_size = size;
+		new_block->segment_id = block->segment_id;
+		NEXT_BLOCK(new_block)->prev_size = new_block->size;
+
+		/* Shrink original block */
+		block->size = size;
+
+		insert_free_block(base, seg, new_block);
+	}
+}
+
+/*
+ * Splits a block like split_block(), but carves the allocation from its end so that the front
+ * stays free where it is. Long-lived blocks collect at the top of their segment this way.
+ * The block must already be unlinked from the free list; the front is added to the free list or tree.
+ * Returns the block to allocate.
+ */
+block_header* split_block_top(char* base, segment* seg, block_header* block, size_t size){
+	block_header* new_block;
+	assert(block != NULL);
+	assert(size > 0);
+	if(block->size - size < ((heap_meta*) base)->tuning.min_split_size + sizeof(block_header)) return block;
+	block->size -= size + sizeof(block_header);
+	new_block = NEXT_BLOCK(block);
+	new_block->free = TRUE;
+	new_block->flags = 0;
+	new_block->requested_size = 0;
+	new_block->tag = MY_HEAP_NO_TAG;
+	new_block->kind = KIND_BLOCK;
+	new_block->size = size;
+	new_block->prev_size = block->size;
+	new_block->segment_id = block->segment_id;
+	NEXT_BLOCK(new_block)->prev_size = size;
+	insert_free_block(base, seg, block);
+	return new_block;
+}
+
+/*
+ * Merges two adjacent free blocks into a single larger block.
+ * Neither block may be in the free list or tree, since the merged block's size changes.
+ */
+void merge_blocks(block_header* block1, block_header* block2){
+	assert(block1 != NULL);
+	assert(block2 != NULL);
+	assert(block1->free && block2->free);
+	assert((char*) block1 + sizeof(block_header) + block1->size == (char*) block2);
+	block1->size += block2->size + sizeof(block_header);
+	NEXT_BLOCK(block1)->prev_size = block1->size;
+}
+
+/*
+ * Returns the offset (from the start of the buddy region) of a buddy block.
+ */
+size_t buddy_offset(char* base, segment* seg, block_header* block){
+	return (size_t) ((char*) block - (base + seg->buddy_start));
+}
+
+/*
+ * Sets or clears the bit of the order bitmap that marks the buddy block at offset as free.
+ */
+void buddy_mark(char* base, segment* seg, size_t offset, int order, bool free){
+	unsigned long* bitmap = (unsigned long*) OFFSET_TO_PTR(base, seg->buddy_bitmap[order]);
+	size_t index = offset >> (BUDDY_MIN_SHIFT + order);
+	if(free) bitmap[index / BITS_PER_WORD] |= 1UL << (index % BITS_PER_WORD);
+	else bitmap[index / BITS_PER_WORD] &= ~(1UL << (index % BITS_PER_WORD));
+}
+
+/*
+ * Returns TRUE if the buddy block at offset is a free block of the given order.
+ */
+bool buddy_is_free(char* base, segment* seg, size_t offset, int order){
+	unsigned long* bitmap = (unsigned long*) OFFSET_TO_PTR(base, seg->buddy_bitmap[order]);
+	size_t index = offset >> (BUDDY_MIN_SHIFT + order);
+	return (bitmap[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1UL;
+}
+
+/*
+ * Writes a free block header at offset and pushes the block onto the free list of its order.
+ */
+void buddy_push(char* base, segment* seg, size_t offset, int order){
+	block_header* block = (block_header*) (base + seg->buddy_start + offset);
+	block->size = (BUDDY_MIN_BLOCK << order) - sizeof(block_header);
+	block->prev_size = 0;
+	block->requested_size = 0;
+	block->segment_id = (unsigned short) (seg - (segment*) OFFSET_TO_PTR(base, ((heap_meta*) base)->segments));
+	block->tag = MY_HEAP_NO_TAG;
+	block->flags = 0;
+	block->kind = KIND_BLOCK;
+	block->free = TRUE;
+	seg->buddy_free[order] = add_to_free_list(base, seg->buddy_free[order], block);
+	buddy_mark(base, seg, offset, order, TRUE);
+}
+
+/*
+ * Frees the buddy block of the given order at offset, merging it with its buddy for as long as
+ * the buddy is free too.
+ */
+void buddy_release(char* base, segment* seg, size_t offset, int order){
+	while(order + 1 < seg->buddy_orders){
+		size_t partner = offset ^ (BUDDY_MIN_BLOCK << order);
+		if(partner + (BUDDY_MIN_BLOCK << order) > seg->buddy_size || !buddy_is_free(base, seg, partner, order)) break;
+		remove_from_free_list(base, &seg->buddy_free[order], (block_header*) (base + seg->buddy_start + partner));
+		buddy_mark(base, seg, partner, order, FALSE);
+		if(partner < offset) offset = partner;
+		order++;
+	}
+	buddy_push(base, seg, offset, order);
+}
+
+/*
+ * Frees length bytes starting at offset (both multiples of BUDDY_MIN_BLOCK) as the largest
+ * aligned power-of-two blocks that fit, in address order.
+ */
+void buddy_release_range(char* base, segment* seg, size_t offset, size_t length){
+	size_t end = offset + length;
+	while(offset < end){
+		int order = 0;
+		while(order + 1 < seg->buddy_orders && offset % (BUDDY_MIN_BLOCK << (order + 1)) == 0 && offset + (BUDDY_MIN_BLOCK << (order + 1)) <= end){
+			order++;
+		}
+		buddy_release(base, seg, offset, order);
+		offset += BUDDY_MIN_BLOCK << order;
+	}
+}
+
+/*
+ * Lays out a buddy segment: the order bitmaps at its start, then the page aligned buddy region,
+ * which is formed into maximal power-of-two free blocks.
+ */
+void initialize_buddy_blocks(char* base, segment* seg){
+	size_t bitmap_bytes = 0;
+	size_t end = seg->start + seg->size;
+	int order;
+	/* Bitmaps are sized for the whole segment, which bounds the region that follows them */
+	for(order = 0; order < BUDDY_MAX_ORDERS && (BUDDY_MIN_BLOCK << order) <= seg->size; order++){
+		size_t blocks = seg->size >> (BUDDY_MIN_SHIFT + order);
+		seg->buddy_bitmap[order] = seg->start + bitmap_bytes;
+		bitmap_bytes += (blocks + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(unsigned long);
+	}
+	memset(base + seg->start, 0, bitmap_bytes);
+	seg->buddy_start = ALIGN_UP(seg->start + bitmap_bytes, BUDDY_MIN_BLOCK);
+	seg->buddy_size = seg->buddy_start < end ? ALIGN_DOWN(end - seg->buddy_start, BUDDY_MIN_BLOCK) : 0;
+	for(seg->buddy_orders = 0; seg->buddy_orders < order && (BUDDY_MIN_BLOCK << seg->buddy_orders) <= seg->buddy_size; seg->buddy_orders++){
+		seg->buddy_free[seg->buddy_orders] = NULL_OFFSET;
+	}
+	seg->free_list = NULL_OFFSET;
+	buddy_release_range(base, seg, 0, seg->buddy_size);
+}
+
+/*
+ * Allocates a block for size payload bytes from a buddy segment: the head of the free list of the
+ * smallest sufficient order is split down, and the tail beyond the pages actually needed is freed again.
+ * With top set, the highest free block of any sufficient order is used and the allocation is carved
+ * from the upper halves and the end of the block instead, so long-lived blocks collect at the top.
+ * Returns the allocated block (with its free flag still set) or NULL if none is large enough.
+ */
+block_header* buddy_allocate(char* base, segment* seg, size_t size, bool top){
+	size_t needed = ALIGN_UP(size + sizeof(block_header), BUDDY_MIN_BLOCK);
+	block_header* block;
+	size_t offset;
+	int order = 0;
+	int order_found = 0;
+	int k;
+	while(order < seg->buddy_orders && (BUDDY_MIN_BLOCK << order) < needed) order++;
+	for(k = order; k < seg->buddy_orders && seg->buddy_free[k] == NULL_OFFSET; k++);
+	if(k >= seg->buddy_orders) return NULL;
+	if(top){
+		/* The highest free block of any sufficient order, found in the order bitmaps from the top down */
+		size_t highest = 0;
+		bool found = FALSE;
+		int j;
+		for(j = k; j < seg->buddy_orders; j++){
+			unsigned long* bitmap = (unsigned long*) OFFSET_TO_PTR(base, seg->buddy_bitmap[j]);
+			int shift = BUDDY_MIN_SHIFT + j;
+			size_t word = ((seg->buddy_size >> shift) + BITS_PER_WORD - 1) / BITS_PER_WORD;
+			if(seg->buddy_free[j] == NULL_OFFSET) continue;
+			/* Words that only cover blocks below the best one so far need not be looked at */
+			while(word > 0 && (!found || ((word * BITS_PER_WORD) << shift) > highest + (BUDDY_MIN_BLOCK << k))){
+				word--;
+				if(bitmap[word] == 0) continue;
+				offset = (word * BITS_PER_WORD + floor_log2(bitmap[word])) << shift;
+				if(!found || offset > highest){
+					highest = offset;
+					order_found = j;
+					found = TRUE;
+				}
+				break;
+			}
+		}
+		k = order_found;
+		offset = highest;
+		block = (block_header*) (base + seg->buddy_start + offset);
+	}else{
+		block = (block_header*) OFFSET_TO_PTR(base, seg->buddy_free[k]);
+		offset = buddy_offset(base, seg, block);
+	}
+	remove_from_free_list(base, &seg->buddy_free[k], block);
+	buddy_mark(base, seg, offset, k, FALSE);
+	/* Split down to the needed order; the other halves cannot merge with the block being split */
+	while(k > order){
+		k--;
+		if(top){
+			buddy_push(base, seg, offset, k);
+			offset += BUDDY_MIN_BLOCK << k;
+		}else{
+			buddy_push(base, seg, offset + (BUDDY_MIN_BLOCK << k), k);
+		}
+	}
+	if(needed < (BUDDY_MIN_BLOCK << order)){
+		if(top){
+			buddy_release_range(base, seg, offset, (BUDDY_MIN_BLOCK << order) - needed);
+			offset += (BUDDY_MIN_BLOCK << order) - needed;
+		}else{
+			buddy_release_range(base, seg, offset + needed, (BUDDY_MIN_BLOCK << order) - needed);
+		}
+	}
+	block = (block_header*) (base + seg->buddy_start + offset);
+	if(top){
+		/* The allocation does not start at the header of the block it was carved from */
+		block->prev_size = 0;
+		block->requested_size = 0;
+		block->segment_id = (unsigned short) (seg - (segment*) OFFSET_TO_PTR(base, ((heap_meta*) base)->segments));
+		block->tag = MY_HEAP_NO_TAG;
+		block->flags = 0;
+		block->kind = KIND_BLOCK;
+		block->free = TRUE;
+	}
+	block->size = needed - sizeof(block_header);
+	return block;
+}
+
+/*
+ * Returns a block to a buddy segment as the aligned power-of-two blocks it was carved from.
+ */
+void buddy_free(char* base, segment* seg, block_header* block){
+	buddy_release_range(base, seg, buddy_offset(base, seg, block), block->size + sizeof(block_header));
+}
+
+/*
+ * Rebuilds the free lists of a buddy segment from its order bitmaps, which are the authoritative record of free blocks.
+ */
+void rebuild_buddy_lists(char* base, segment* seg){
+	int order;
+	size_t offset;
+	for(order = 0; order < seg->buddy_orders; order++){
+		seg->buddy_free[order] = NULL_OFFSET;
+		for(offset = 0; offset + (BUDDY_MIN_BLOCK << order) <= seg->buddy_size; offset += BUDDY_MIN_BLOCK << order){
+			if(buddy_is_free(base, seg, offset, order)) buddy_push(base, seg, offset, order);
+		}
+	}
+}
+
+/*
+ * Takes a free block of at least size payload bytes from a segment according to its policy,
+ * splitting off and freeing whatever is not needed. Called with the segment lock held.
+ * With top set (long-lived blocks), list segments take the highest block that fits and every
+ * policy carves the allocation from the end of the free block, away from short-lived churn.
+ * Returns the block (still to be marked as allocated) or NULL if none is large enough.
+ */
+block_header* take_free_block(char* base, segment* seg, size_t size, bool top){
+	block_header* block;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY) return buddy_allocate(base, seg, size, top);
+	if(top){
+		if(seg->policy == MY_HEAP_POLICY_INDEXED) block = tree_find_best_fit(base, seg, size);
+		else if(seg->policy == MY_HEAP_POLICY_TLSF) block = tlsf_find(base, seg, size);
+		else block = find_highest_fit(base, seg->free_list, size);
+		if(block == NULL) return NULL;
+		unlink_free_block(base, seg, block);
+		return split_block_top(base, seg, block, size);
+	}
+	switch(seg->policy){
+		case MY_HEAP_POLICY_INDEXED:
+			block = tree_find_best_fit(base, seg, size);
+			break;
+		case MY_HEAP_POLICY_FIRST_FIT:
+			block = find_first_fit(base, seg->free_list, size);
+			break;
+		case MY_HEAP_POLICY_NEXT_FIT:
+			block = find_next_fit(base, seg, size);
+			break;
+		case MY_HEAP_POLICY_TLSF:
+			block = tlsf_find(base, seg, size);
+			break;
+		case MY_HEAP_POLICY_GOOD_FIT:
+			block = find_good_fit(base, seg->free_list, size, size / 100 * ((heap_meta*) base)->good_fit_percent);
+			break;
+		default:
+			block = find_best_fit(base, seg->free_list, size);
+			break;
+	}
+	if(block == NULL) return NULL;
+	unlink_free_block(base, seg, block);
+	split_block(base, seg, block, size);
+	return block;
+}
+
+/*
+ * Returns an allocated block to its segment according to the segment's policy, coalescing it
+ * with free neighbours. Called with the segment lock held.
+ * If this empties a region borrowed from the large segment, the region is detached from the
+ * segment and the lent block is returned so the caller can give it back.
+ */
+block_header* return_free_block(char* base, segment* seg, block_header* block){
+	block_header* neighbour;
+	block->free = TRUE;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY){
+		buddy_free(base, seg, block);
+		return NULL;
+	}
+	/* Coalesce with the physically preceding block */
+	if(!(block->flags & BLOCK_FIRST)){
+		neighbour = PREV_BLOCK(block);
+		if(neighbour->free){
+			unlink_free_block(base, seg, neighbour);
+			merge_blocks(neighbour, block);
+			block = neighbour;
+		}
+	}
+	/* Coalesce with the physically following block; the segment fence is never free */
+	neighbour = NEXT_BLOCK(block);
+	if(neighbour->free){
+		unlink_free_block(base, seg, neighbour);
+		merge_blocks(block, neighbour);
+	}
+	if((block->flags & BLOCK_BORROWED) && (NEXT_BLOCK(block)->flags & BLOCK_FENCE)){
+		block_header* loan = (block_header*) ((char*) block - sizeof(block_header));
+		if(loan->prev != NULL_OFFSET) ((block_header*) OFFSET_TO_PTR(base, loan->prev))->next = loan->next;
+		else seg->loans = loan->next;
+		if(loan->next != NULL_OFFSET) ((block_header*) OFFSET_TO_PTR(base, loan->next))->prev = loan->prev;
+		return loan;
+	}
+	insert_free_block(base, seg, block);
+	return NULL;
+}
+
+/*
+ * Walks the blocks of one region of a segment in address order and adds its free blocks to the
+ * segment's free list or tree, coalescing adjacent ones. Returns FALSE if the block headers are inconsistent.
+ */
+bool rebuild_region(char* base, segment* seg, int seg_id, block_header* block, char* end){
+	block_header* previous = NULL;
+	/* Free block being coalesced; it is indexed once its run of free blocks ends */
+	block_header* run = NULL;
+	while(1){
+		if((char*) block + sizeof(block_header) > end || block->segment_id != seg_id) return FALSE;
+		if(previous == NULL ? !(block->flags & BLOCK_FIRST) : block->prev_size != previous->size) return FALSE;
+		if(block->flags & BLOCK_FENCE) break;
+		if((char*) NEXT_BLOCK(block) + sizeof(block_header) > end) return FALSE;
+		if(block->free){
+			if(run != NULL){
+				run->size += block->size + sizeof(block_header);
+				NEXT_BLOCK(run)->prev_size = run->size;
+				block = NEXT_BLOCK(run);
+				continue;
+			}
+			run = block;
+		}else if(run != NULL){
+			insert_free_block(base, seg, run);
+			run = NULL;
+		}
+		previous = block;
+		block = NEXT_BLOCK(block);
+	}
+	if(run != NULL) insert_free_block(base, seg, run);
+	return (char*) block + sizeof(block_header) == end;
+}
+
+/*
+ * Rebuilds the free list of a segment by walking its own blocks and those of its borrowed regions.
+ * Used when a persistent heap was not shut down cleanly; adjacent free blocks are coalesced.
+ * Buddy segments are rebuilt from their bitmaps instead.
+ * Returns FALSE if the block headers are inconsistent.
+ */
+bool rebuild_free_list(char* base, segment* seg, int seg_id){
+	block_header* loan;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY){
+		rebuild_buddy_lists(base, seg);
+		return TRUE;
+	}
+	seg->free_list = NULL_OFFSET;
+	seg->rover = NULL_OFFSET;
+	if(seg->policy == MY_HEAP_POLICY_TLSF) tlsf_clear(base, seg);
+	if(!rebuild_region(base, seg, seg_id, (block_header*) OFFSET_TO_PTR(base, seg->start), base + seg->start + seg->size)) return FALSE;
+	for(loan = (block_header*) OFFSET_TO_PTR(base, seg->loans); loan != NULL; loan = (block_header*) OFFSET_TO_PTR(base, loan->next)){
+		if(!rebuild_region(base, seg, seg_id, loan + 1, (char*) loan + sizeof(block_header) + loan->size)) return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Locks a segment on the allocation or free path, counting the acquisitions that had to wait.
+ */
+void lock_segment(segment* seg){
+	if(pthread_mutex_trylock(&seg->lock) != 0){
+		pthread_mutex_lock(&seg->lock);
+		seg->lock_contended++;
+	}
+	seg->lock_acquisitions++;
+}
+
+/*
+ * Handles large allocations by waiting for a free block to become available.
+ * Blocks the calling thread until a suitable block is found.
+ * Returns a pointer to the block taken from the segment (with the segment lock held) or NULL if not found.
+ */
+block_header* wait_for_free_block(char* base, segment* seg, size_t size, bool top){
+	struct timespec timeout;
+	time_t start_time;
+	block_header* block = NULL;
+
+	lock_segment(seg);
+	assert(seg != NULL);
+	assert(size > 0);
+	start_time = time(NULL);
+	timeout.tv_sec = start_time + (time_t) MAX_WAIT_TIME;
+	/* Nanoseconds not used here */
+	timeout.tv_nsec = 0;
+	while(1){
+		int rc;
+		block = take_free_block(base, seg, size, top);
+		/* Real-time heaps never sleep; the caller fails instead */
+		if(block != NULL || size > seg->size || (((heap_meta*) base)->flags & MY_HEAP_REALTIME)) break;
+		/* Wait for a free block to become available with a timeout */
+		seg->waits++;
+		rc = pthread_cond_timedwait(&seg->condition, &seg->lock, &timeout);
+		if(rc == ETIMEDOUT){
+			seg->wait_timeouts++;
+			break;
+		}
+	}
+
+	if(block == NULL) pthread_mutex_unlock(&seg->lock);
+
+	return block;
+}
+
+/*
+ * Returns TRUE if tuning parameters are usable: a sane segment split and sorted, aligned size classes.
+ */
+bool is_valid_tuning(const my_heap_tuning_t* tuning){
+	int i;
+	if(tuning->small_percent < 1 || tuning->small_percent + tuning->medium_percent > 99) return FALSE;
+	if(tuning->medium_percent > 0 && tuning->medium_size == 0) return FALSE;
+	if(tuning->large_size == 0 || tuning->min_split_size == 0) return FALSE;
+	if(tuning->num_size_classes < 0 || tuning->num_size_classes > MY_HEAP_MAX_SIZE_CLASSES) return FALSE;
+	for(i = 0; i < tuning->num_size_classes; i++){
+		if(tuning->size_classes[i] == 0 || tuning->size_classes[i] % ALIGNMENT != 0) return FALSE;
+		if(i > 0 && tuning->size_classes[i] <= tuning->size_classes[i-1]) return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Returns the histogram bucket of a request size.
+ */
+int histogram_bucket(size_t size){
+	int log2;
+	int bucket;
+	size = ALIGN_UP(size, ALIGNMENT);
+	log2 = floor_log2(size);
+	bucket = (log2 - floor_log2(ALIGNMENT)) * HISTOGRAM_SUB_BUCKETS;
+	if(log2 >= 2) bucket += (int) ((size >> (log2 - 2)) & (HISTOGRAM_SUB_BUCKETS - 1));
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Records a request in the histogram of the segment that handled it first.
+ * Must be called with the segment lock held.
+ * Returns TRUE if enough requests were recorded since the last tuning that the heap should be retuned.
+ */
+bool record_request(heap_meta* meta, segment* seg, size_t size){
+	int bucket = histogram_bucket(size);
+	seg->histogram_count[bucket]++;
+	seg->histogram_bytes[bucket] += size;
+	if(size > seg->histogram_max[bucket]) seg->histogram_max[bucket] = size;
+	if(meta->tune_interval == 0) return FALSE;
+	if(++seg->allocations_since_tune < meta->tune_interval / meta->num_small_segments) return FALSE;
+	seg->allocations_since_tune = 0;
+	return TRUE;
+}
+
+/*
+ * Rounds a request up to the smallest size class that holds it.
+ * Requests larger than the largest class are returned unchanged.
+ * The classes are read without a lock, so a result smaller than the request (seen while
+ * my_heap_tune() replaces the classes) is never returned.
+ */
+size_t round_to_size_class(const my_heap_tuning_t* tuning, size_t size){
+	int low = 0;
+	int high = tuning->num_size_classes;
+	if(high == 0 || size > tuning->size_classes[high-1]) return size;
+	while(low < high){
+		int mid = (low + high) / 2;
+		if(tuning->size_classes[mid] < size) low = mid + 1;
+		else high = mid;
+	}
+	return tuning->size_classes[low] >= size ? tuning->size_classes[low] : size;
+}
+
+/*
+ * Chooses up to MY_HEAP_MAX_SIZE_CLASSES size classes for the given histogram buckets.
+ * Each class is the (aligned) largest request seen in its last bucket, so the waste of a class
+ * spanning buckets i..j is exactly class size * count(i..j) - bytes(i..j).
+ * A dynamic program over the non-empty buckets finds the boundaries that minimize total waste.
+ * Returns the number of classes written to classes.
+ */
+int derive_size_classes(const unsigned long* count, const unsigned long* bytes, const size_t* max, int num_buckets, size_t* classes){
+	int used[HISTOGRAM_BUCKETS];
+	double prefix_count[HISTOGRAM_BUCKETS + 1];
+	double prefix_bytes[HISTOGRAM_BUCKETS + 1];
+	double cost[MY_HEAP_MAX_SIZE_CLASSES + 1][HISTOGRAM_BUCKETS + 1];
+	int choice[MY_HEAP_MAX_SIZE_CLASSES + 1][HISTOGRAM_BUCKETS + 1];
+	int m = 0;
+	int k;
+	int i;
+	int j;
+	int num_classes;
+	for(i = 0; i < num_buckets; i++){
+		if(count[i] > 0) used[m++] = i;
+	}
+	if(m == 0) return 0;
+	prefix_count[0] = 0;
+	prefix_bytes[0] = 0;
+	for(i = 0; i < m; i++){
+		prefix_count[i+1] = prefix_count[i] + (double) count[used[i]];
+		prefix_bytes[i+1] = prefix_bytes[i] + (double) bytes[used[i]];
+	}
+	num_classes = m < MY_HEAP_MAX_SIZE_CLASSES ? m : MY_HEAP_MAX_SIZE_CLASSES;
+	/* cost[k][j]: minimum waste covering the first j used buckets with k classes (choice -1 if impossible) */
+	for(j = 0; j <= m; j++){
+		cost[0][j] = 0;
+		choice[0][j] = j == 0 ? 0 : -1;
+	}
+	for(k = 1; k <= num_classes; k++){
+		for(j = 0; j <= m; j++){
+			cost[k][j] = 0;
+			choice[k][j] = -1;
+			for(i = k - 1; i < j; i++){
+				double class_size;
+				double waste;
+				if(choice[k-1][i] < 0) continue;
+				class_size = (double) ALIGN_UP(max[used[j-1]], ALIGNMENT);
+				waste = cost[k-1][i] + class_size * (prefix_count[j] - prefix_count[i]) - (prefix_bytes[j] - prefix_bytes[i]);
+				if(choice[k][j] < 0 || waste < cost[k][j]){
+					cost[k][j] = waste;
+					choice[k][j] = i;
+				}
+			}
+		}
+	}
+	/* Walk the boundaries back from the last bucket */
+	j = m;
+	for(k = num_classes; k > 0; k--){
+		classes[k-1] = ALIGN_UP(max[used[j-1]], ALIGNMENT);
+		j = choice[k][j];
+	}
+	return num_classes;
+}
+
+int my_heap_tune(my_heap_t* heap){
+	unsigned long count[HISTOGRAM_BUCKETS];
+	unsigned long bytes[HISTOGRAM_BUCKETS];
+	size_t max[HISTOGRAM_BUCKETS];
+	my_heap_tuning_t tuning;
+	unsigned long total_count = 0;
+	double total_bytes = 0;
+	double small_bytes = 0;
+	double medium_bytes = 0;
+	size_t small_size;
+	unsigned long seen = 0;
+	int small_buckets;
+	int i;
+	int b;
+	assert(heap != NULL);
+	memset(count, 0, sizeof(count));
+	memset(bytes, 0, sizeof(bytes));
+	memset(max, 0, sizeof(max));
+	pthread_mutex_lock(&heap->tune_mutex);
+	/* Collect the histograms and halve them so older requests gradually lose weight */
+	for(i = 0; i < heap->meta->num_segments; i++){
+		segment* seg = heap->segments + i;
+		pthread_mutex_lock(&seg->lock);
+		for(b = 0; b < HISTOGRAM_BUCKETS; b++){
+			count[b] += seg->histogram_count[b];
+			bytes[b] += seg->histogram_bytes[b];
+			if(seg->histogram_max[b] > max[b]) max[b] = seg->histogram_max[b];
+			seg->histogram_count[b] /= 2;
+			seg->histogram_bytes[b] /= 2;
+			if(seg->histogram_count[b] == 0) seg->histogram_max[b] = 0;
+		}
+		seg->allocations_since_tune = 0;
+		pthread_mutex_unlock(&seg->lock);
+	}
+	for(b = 0; b < HISTOGRAM_BUCKETS; b++){
+		total_count += count[b];
+		total_bytes += (double) bytes[b];
+	}
+	if(total_count < MIN_TUNE_SAMPLES){
+		pthread_mutex_unlock(&heap->tune_mutex);
+		return -1;
+	}
+	tuning = heap->meta->tuning;
+	/* The largest 1% of requests (but nothing bigger than a quarter of a medium, or else small, segment) go to the large segment */
+	tuning.large_size = (heap->segments + (heap->meta->num_medium_segments > 0 ? heap->meta->num_small_segments : 0))->size / 4;
+	for(b = 0; b < HISTOGRAM_BUCKETS; b++){
+		seen += count[b];
+		if(count[b] > 0 && seen >= total_count - total_count / 100){
+			if(max[b] < tuning.large_size) tuning.large_size = ALIGN_UP(max[b], ALIGNMENT);
+			break;
+		}
+	}
+	/* Size classes only cover requests served by the small segments */
+	small_size = tuning.large_size;
+	if(heap->meta->num_medium_segments > 0 && tuning.medium_size < small_size) small_size = tuning.medium_size;
+	small_buckets = histogram_bucket(small_size) + 1;
+	for(b = 0; b < small_buckets; b++){
+		if(max[b] > small_size){
+			small_buckets = b;
+			break;
+		}
+		small_bytes += (double) bytes[b];
+	}
+	for(b = small_buckets; b < HISTOGRAM_BUCKETS && max[b] <= tuning.large_size; b++){
+		medium_bytes += (double) bytes[b];
+	}
+	tuning.num_size_classes = derive_size_classes(count, bytes, max, small_buckets, tuning.size_classes);
+	/* A remainder smaller than the smallest class can never be used, so don't split it off */
+	tuning.min_split_size = MIN_SPLIT_SIZE;
+	if(tuning.num_size_classes > 0 && tuning.size_classes[0] > tuning.min_split_size) tuning.min_split_size = tuning.size_classes[0];
+	/* Give the small and medium segments the share of the heap that their requests ask for (applies to new heaps) */
+	tuning.small_percent = (unsigned int) (100.0 * small_bytes / total_bytes + 0.5);
+	if(tuning.small_percent < 5) tuning.small_percent = 5;
+	if(tuning.small_percent > 95) tuning.small_percent = 95;
+	if(heap->meta->num_medium_segments > 0){
+		tuning.medium_percent = (unsigned int) (100.0 * medium_bytes / total_bytes + 0.5);
+		if(tuning.medium_percent < 5) tuning.medium_percent = 5;
+		if(tuning.small_percent + tuning.medium_percent > 95) tuning.medium_percent = 95 - tuning.small_percent;
+		if(tuning.medium_percent < 5){
+			tuning.medium_percent = 5;
+			tuning.small_percent = 90;
+		}
+	}
+	heap->meta->tuning = tuning;
+	pthread_mutex_unlock(&heap->tune_mutex);
+	return 0;
+}
+
+void my_heap_get_tuning(my_heap_t* heap, my_heap_tuning_t* tuning){
+	assert(heap != NULL);
+	assert(tuning != NULL);
+	pthread_mutex_lock(&heap->tune_mutex);
+	*tuning = heap->meta->tuning;
+	pthread_mutex_unlock(&heap->tune_mutex);
+}
+
+/*
+ * Updates the usage of a segment by the bytes of an allocated or freed block.
+ * Must be called with the segment lock held.
+ * Returns the pressure event caused by crossing a segment watermark, if any.
+ */
+pressure_event update_segment_usage(heap_meta* meta, segment* seg, int seg_id, size_t bytes, bool allocated){
+	pressure_event event;
+	size_t high = (size_t) ((double) seg->size * meta->segment_high_percent / 100.0);
+	size_t low = (size_t) ((double) seg->size * meta->segment_low_percent / 100.0);
+	event.level = NO_PRESSURE_EVENT;
+	if(allocated) seg->bytes_in_use += bytes;
+	else seg->bytes_in_use -= bytes;
+	if(meta->segment_high_percent == 0) return event;
+	if(!seg->under_pressure && seg->bytes_in_use >= high){
+		seg->under_pressure = TRUE;
+		event.level = MY_HEAP_PRESSURE_HIGH;
+	}else if(seg->under_pressure && seg->bytes_in_use <= low){
+		seg->under_pressure = FALSE;
+		event.level = MY_HEAP_PRESSURE_LOW;
+	}
+	event.segment_id = seg_id;
+	event.bytes_in_use = seg->bytes_in_use;
+	event.capacity = seg->size;
+	return event;
+}
+
+/*
+ * Updates the usage of the whole heap without a lock.
+ * Only the thread whose update wins the state change reports the crossing.
+ * Returns the pressure event caused by crossing a heap watermark, if any.
+ */
+pressure_event update_heap_usage(heap_meta* meta, size_t bytes, bool allocated){
+	pressure_event event;
+	size_t in_use;
+	event.level = NO_PRESSURE_EVENT;
+	if(allocated) in_use = __sync_add_and_fetch(&meta->bytes_in_use, bytes);
+	else in_use = __sync_sub_and_fetch(&meta->bytes_in_use, bytes);
+	if(meta->high_watermark == 0) return event;
+	if(in_use >= meta->high_watermark && !meta->under_pressure){
+		if(__sync_bool_compare_and_swap(&meta->under_pressure, FALSE, TRUE)) event.level = MY_HEAP_PRESSURE_HIGH;
+	}else if(in_use <= meta->low_watermark && meta->under_pressure){
+		if(__sync_bool_compare_and_swap(&meta->under_pressure, TRUE, FALSE)) event.level = MY_HEAP_PRESSURE_LOW;
+	}
+	event.segment_id = -1;
+	event.bytes_in_use = in_use;
+	event.capacity = meta->capacity;
+	return event;
+}
+
+/*
+ * Invokes the heap's pressure callbacks for an event. Must be called without any segment lock held,
+ * so callbacks may free memory from the heap.
+ */
+void notify_pressure(my_heap_t* heap, pressure_event event){
+	pressure_callback callbacks[MAX_PRESSURE_CALLBACKS];
+	int num_callbacks;
+	int i;
+	if(event.level == NO_PRESSURE_EVENT || heap->num_callbacks == 0) return;
+	pthread_mutex_lock(&heap->callback_mutex);
+	num_callbacks = heap->num_callbacks;
+	memcpy(callbacks, heap->callbacks, sizeof(pressure_callback) * num_callbacks);
+	pthread_mutex_unlock(&heap->callback_mutex);
+	for(i = 0; i < num_callbacks; i++){
+		callbacks[i].callback(heap, event.level, event.segment_id, event.bytes_in_use, event.capacity, callbacks[i].arg);
+	}
+}
+
+int my_heap_add_pressure_callback(my_heap_t* heap, my_heap_pressure_callback_t callback, void* arg){
+	int rc = -1;
+	assert(heap != NULL);
+	assert(callback != NULL);
+	pthread_mutex_lock(&heap->callback_mutex);
+	if(heap->num_callbacks < MAX_PRESSURE_CALLBACKS){
+		heap->callbacks[heap->num_callbacks].callback = callback;
+		heap->callbacks[heap->num_callbacks].arg = arg;
+		heap->num_callbacks++;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&heap->callback_mutex);
+	return rc;
+}
+
+void my_heap_remove_pressure_callback(my_heap_t* heap, my_heap_pressure_callback_t callback, void* arg){
+	int i;
+	assert(heap != NULL);
+	pthread_mutex_lock(&heap->callback_mutex);
+	for(i = 0; i < heap->num_callbacks; i++){
+		if(heap->callbacks[i].callback == callback && heap->callbacks[i].arg == arg){
+			heap->callbacks[i] = heap->callbacks[heap->num_callbacks - 1];
+			heap->num_callbacks--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&heap->callback_mutex);
+}
+
+void my_heap_set_watermarks(my_heap_t* heap, size_t high_watermark, size_t low_watermark, unsigned int segment_high_percent, unsigned int segment_low_percent){
+	assert(heap != NULL);
+	assert(low_watermark <= high_watermark);
+	assert(segment_low_percent <= segment_high_percent);
+	heap->meta->high_watermark = high_watermark;
+	heap->meta->low_watermark = low_watermark;
+	heap->meta->segment_high_percent = segment_high_percent;
+	heap->meta->segment_low_percent = segment_low_percent;
+}
+
+size_t my_heap_bytes_in_use(my_heap_t* heap){
+	assert(heap != NULL);
+	return heap->meta->bytes_in_use;
+}
+
+my_heap_config_t my_heap_config_default(){
+	my_heap_config_t config;
+	config.total_size = TOTAL_SIZE;
+	config.flags = 0;
+	config.shm_name = NULL;
+	config.path = NULL;
+	config.tuning.small_percent = SMALL_PERCENT;
+	config.tuning.large_size = LARGE_SIZE;
+	config.tuning.medium_percent = MEDIUM_PERCENT;
+	config.tuning.medium_size = MEDIUM_SIZE;
+	config.tuning.min_split_size = MIN_SPLIT_SIZE;
+	config.tuning.num_size_classes = 0;
+	config.tune_interval = 0;
+	config.high_watermark = 0;
+	config.low_watermark = 0;
+	config.segment_high_percent = 0;
+	config.segment_low_percent = 0;
+	config.bump_max_size = BUMP_MAX_SIZE;
+	config.bump_chunk_size = BUMP_CHUNK_SIZE;
+	config.scope_chunk_size = SCOPE_CHUNK_SIZE;
+	config.huge_size = HUGE_SIZE;
+	config.loan_size = LOAN_SIZE;
+	config.maintenance_interval = 0;
+	config.stats_path = NULL;
+	config.stats_interval = STATS_INTERVAL;
+	config.small_policy = MY_HEAP_POLICY_BEST_FIT;
+	config.good_fit_percent = GOOD_FIT_PERCENT;
+	config.segment_selection = MY_HEAP_SELECT_ROUND_ROBIN;
+	config.num_small_segments = 0;
+	config.medium_policy = MY_HEAP_POLICY_BUDDY;
+	config.large_policy = MY_HEAP_POLICY_BUDDY;
+	return config;
+}
+
+/*
+ * Allocates and initializes the process-local part of a heap for a mapping.
+ * flags are the heap's MY_HEAP_* flags, which decide how its mutexes are initialized.
+ * Returns the heap or NULL if unsuccessful.
+ */
+my_heap_t* new_heap_handle(char* base_ptr, size_t mapping_size, int fd, bool owner, int flags){
+	my_heap_t* heap = (my_heap_t*) malloc(sizeof(my_heap_t));
+	if(heap == NULL) return NULL;
+	heap->base_ptr = base_ptr;
+	heap->meta = (heap_meta*) base_ptr;
+	heap->segments = NULL;
+	heap->mapping_size = mapping_size;
+	heap->fd = fd;
+	heap->owner = owner;
+	heap->relocated = FALSE;
+	heap->shm_name = NULL;
+	heap->current_segment = 0;
+	heap->current_medium_segment = 0;
+	heap->next_heap = NULL;
+	initialize_heap_mutexes(heap, (flags & MY_HEAP_REALTIME) != 0);
+	heap->num_callbacks = 0;
+	heap->has_thread_key = pthread_key_create(&heap->thread_key, release_thread_state) == 0;
+	heap->thread_states = NULL;
+	heap->orphans = NULL;
+	heap->num_orphans = 0;
+	heap->immortal_chunk = NULL;
+	heap->immortal_bump = NULL;
+	heap->immortal_end = NULL;
+	heap->immortal_allocated = 0;
+	heap->huge_blocks = NULL;
+	heap->maintenance_running = FALSE;
+	heap->maintenance_stop = FALSE;
+	heap->maintenance_interval = 0;
+	pthread_cond_init(&heap->maintenance_condition, NULL);
+	heap->tune_pending = FALSE;
+	heap->stats_path = NULL;
+	heap->stats_interval = 0;
+	memset(heap->malloc_latency, 0, sizeof(heap->malloc_latency));
+	heap->malloc_latency_ns = 0;
+	memset(heap->free_latency, 0, sizeof(heap->free_latency));
+	heap->free_latency_ns = 0;
+	return heap;
+}
+
+/*
+ * Releases the process-local part of a heap and unmaps its memory.
+ */
+void release_heap_handle(my_heap_t* heap){
+	thread_state* state;
+	/* Threads that still have a state never publish it; the heap is going away */
+	if(heap->has_thread_key) pthread_key_delete(heap->thread_key);
+	while(heap->thread_states != NULL){
+		state = heap->thread_states;
+		heap->thread_states = state->next_state;
+		free(state);
+	}
+	pthread_mutex_destroy(&heap->thread_state_mutex);
+	pthread_mutex_destroy(&heap->immortal_mutex);
+	while(heap->huge_blocks != NULL){
+		huge_header* huge = heap->huge_blocks;
+		heap->huge_blocks = huge->next;
+		munmap(huge, huge->mapping_size);
+	}
+	pthread_mutex_destroy(&heap->huge_mutex);
+	pthread_mutex_destroy(&heap->maintenance_mutex);
+	pthread_cond_destroy(&heap->maintenance_condition);
+	munmap(heap->base_ptr, heap->mapping_size);
+	if(heap->fd >= 0) close(heap->fd);
+	pthread_mutex_destroy(&heap->round_robin_mutex);
+	pthread_mutex_destroy(&heap->tune_mutex);
+	pthread_mutex_destroy(&heap->callback_mutex);
+	free(heap->shm_name);
+	free(heap->stats_path);
+	free(heap);
+}
+
+/*
+ * Creates the backing file descriptor of a process-shared heap.
+ * Uses a named POSIX shared memory object if a name is given, otherwise an anonymous memfd.
+ * Returns the file descriptor or -1 if unsuccessful.
+ */
+int create_shared_fd(const char* shm_name, size_t size){
+	int fd;
+	if(shm_name != NULL){
+		fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}else{
+		fd = memfd_create("my_heap", MFD_CLOEXEC);
+	}
+	if(fd < 0) return -1;
+	if(ftruncate(fd, (off_t) size) != 0){
+		close(fd);
+		if(shm_name != NULL) shm_unlink(shm_name);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Opens or creates a MY_HEAP_PERSISTENT heap backed by the file at config->path.
+ * An existing heap file is mapped (at its previous address if possible) and recovered without
+ * touching its allocations; only segment locks are reset and, after an unclean shutdown,
+ * free lists are rebuilt from the block headers. A new or empty file is initialized to config->total_size bytes.
+ * The file stays exclusively locked while the heap is open.
+ * Returns the heap or NULL if unsuccessful, in particular if another heap has the file open.
+ */
+my_heap_t* open_persistent_heap(const my_heap_config_t* config){
+	struct stat st;
+	heap_meta stored;
+	char* base_ptr;
+	my_heap_t* heap;
+	int fd;
+	int i;
+	size_t size = config->total_size;
+	bool existing;
+	assert(config->path != NULL);
+	fd = open(config->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0) return NULL;
+	/* Recovery resets the locks and free lists under any other opener, so only one may have the file open */
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0){
+		close(fd);
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return NULL;
+	}
+	existing = st.st_size > 0;
+	base_ptr = NULL;
+	if(existing){
+		/* Never clobber a file that is not a heap */
+		if(pread(fd, &stored, sizeof(heap_meta), 0) != (ssize_t) sizeof(heap_meta) || stored.magic != HEAP_MAGIC
+			|| stored.total_size != (size_t) st.st_size || !(stored.flags & MY_HEAP_PERSISTENT)){
+			close(fd);
+			return NULL;
+		}
+		size = stored.total_size;
+		/* Prefer the previous address so that raw pointers stored in the heap stay valid */
+		base_ptr = (char*) mmap((void*) stored.base_address, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+		if(base_ptr != MAP_FAILED && base_ptr != (char*) stored.base_address){
+			munmap(base_ptr, size);
+			base_ptr = (char*) MAP_FAILED;
+		}
+	}else if(ftruncate(fd, (off_t) size) != 0){
+		close(fd);
+		unlink(config->path);
+		return NULL;
+	}
+	if(!existing || base_ptr == MAP_FAILED){
+		base_ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if(base_ptr == MAP_FAILED){
+		close(fd);
+		if(!existing) unlink(config->path);
+		return NULL;
+	}
+	heap = new_heap_handle(base_ptr, size, fd, TRUE, existing ? stored.flags : config->flags);
+	if(heap == NULL){
+		munmap(base_ptr, size);
+		close(fd);
+		if(!existing) unlink(config->path);
+		return NULL;
+	}
+	if(!existing){
+		heap->segments = initialize_allocator(heap, config->flags | MY_HEAP_PERSISTENT, config);
+		if(heap->segments == NULL){
+			release_heap_handle(heap);
+			unlink(config->path);
+			return NULL;
+		}
+		return heap;
+	}
+	/* Locks left behind by the previous process are meaningless, so reinitialize them
+	 * (process-shared, since a forked child shares the file mapping) */
+	heap->segments = (segment*) OFFSET_TO_PTR(base_ptr, heap->meta->segments);
+	for(i = 0; i < heap->meta->num_segments; i++){
+		initialize_segment_locks(heap->segments + i, TRUE, (heap->meta->flags & MY_HEAP_REALTIME) != 0);
+		if(!heap->meta->clean && !rebuild_free_list(base_ptr, heap->segments + i, i)){
+			release_heap_handle(heap);
+			return NULL;
+		}
+	}
+	heap->relocated = heap->meta->base_address != (size_t) base_ptr;
+	heap->meta->base_address = (size_t) base_ptr;
+	heap->meta->clean = FALSE;
+	return heap;
+}
+
+/*
+ * Applies the MY_HEAP_PREFAULT and MY_HEAP_LOCKED flags to a newly created or reopened heap.
+ * A reopened persistent heap takes them from the caller rather than from its previous life.
+ * Returns FALSE if its pages could not be locked.
+ */
+bool prepare_heap_pages(my_heap_t* heap, int flags){
+	heap->meta->flags = (heap->meta->flags & ~(MY_HEAP_PREFAULT | MY_HEAP_LOCKED)) | (flags & (MY_HEAP_PREFAULT | MY_HEAP_LOCKED));
+	if(heap->meta->flags & MY_HEAP_PREFAULT) my_heap_prefault(heap, 0);
+	if((heap->meta->flags & MY_HEAP_LOCKED) && mlock(heap->base_ptr, heap->mapping_size) != 0) return FALSE;
+	return TRUE;
+}
+
+my_heap_t* my_heap_create(const my_heap_config_t* config){
+	my_heap_t* heap;
+	char* base_ptr;
+	int fd = -1;
+	my_heap_config_t defaults = my_heap_config_default();
+	if(config == NULL) config = &defaults;
+	if(!is_valid_tuning(&config->tuning)) return NULL;
+	/* Small segments hold thread chunks and borrowed regions, which buddy segments cannot */
+	if(config->small_policy < MY_HEAP_POLICY_BEST_FIT || config->small_policy > MY_HEAP_POLICY_TLSF || config->small_policy == MY_HEAP_POLICY_BUDDY) return NULL;
+	if(config->medium_policy < MY_HEAP_POLICY_BEST_FIT || config->medium_policy > MY_HEAP_POLICY_TLSF) return NULL;
+	if(config->large_policy < MY_HEAP_POLICY_BEST_FIT || config->large_policy > MY_HEAP_POLICY_TLSF) return NULL;
+	/* A chunk must hold at least one object, and object offsets must fit in a bump header */
+	if(config->scope_chunk_size == 0) return NULL;
+	if(config->bump_max_size > 0 && (config->bump_chunk_size < sizeof(chunk_header) + sizeof(bump_header) + ALIGN_UP(config->bump_max_size, ALIGNMENT) || config->bump_chunk_size > 0xffffffffUL)) return NULL;
+	if(config->segment_selection != MY_HEAP_SELECT_ROUND_ROBIN && config->segment_selection != MY_HEAP_SELECT_CPU) return NULL;
+	if(config->num_small_segments < 0 || config->num_small_segments > MAX_SMALL_SEGMENTS) return NULL;
+	/* Each small segment counts its share of the interval, which must not round down to nothing */
+	if(config->tune_interval > 0 && config->tune_interval < (unsigned long) small_segment_count(config)) return NULL;
+	/* Every segment must be able to hold at least one minimum sized block */
+	if(SMALL_SEGMENT_SIZE(config->total_size, config->tuning.small_percent, small_segment_count(config)) < PAGE_SIZE) return NULL;
+	if(config->tuning.medium_percent > 0 && MEDIUM_SEGMENT_SIZE(config->total_size, config->tuning.medium_percent) < PAGE_SIZE) return NULL;
+	if(LARGE_SEGMENT_SIZE(config->total_size, config->tuning.small_percent, config->tuning.medium_percent) < PAGE_SIZE) return NULL;
+	if(config->flags & MY_HEAP_PERSISTENT){
+		heap = open_persistent_heap(config);
+		if(heap == NULL) return NULL;
+		register_heap(heap);
+		if(!prepare_heap_pages(heap, config->flags)){
+			my_heap_destroy(heap);
+			return NULL;
+		}
+		start_maintenance(heap, config);
+		return heap;
+	}
+	if(config->flags & MY_HEAP_SHARED){
+		fd = create_shared_fd(config->shm_name, config->total_size);
+		if(fd < 0) return NULL;
+		base_ptr = (char*) mmap(NULL, config->total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}else{
+		base_ptr = (char*) mmap(NULL, config->total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if(base_ptr == MAP_FAILED){
+		if(fd >= 0) close(fd);
+		if((config->flags & MY_HEAP_SHARED) && config->shm_name != NULL) shm_unlink(config->shm_name);
+		return NULL;
+	}
+	heap = new_heap_handle(base_ptr, config->total_size, fd, TRUE, config->flags);
+	if(heap != NULL && (config->flags & MY_HEAP_SHARED) && config->shm_name != NULL){
+		heap->shm_name = (char*) malloc(strlen(config->shm_name) + 1);
+		if(heap->shm_name != NULL) strcpy(heap->shm_name, config->shm_name);
+	}
+	if(heap != NULL) heap->segments = initialize_allocator(heap, config->flags, config);
+	if(heap == NULL || heap->segments == NULL){
+		if(heap != NULL){
+			release_heap_handle(heap);
+		}else{
+			munmap(base_ptr, config->total_size);
+			if(fd >= 0) close(fd);
+		}
+		if((config->flags & MY_HEAP_SHARED) && config->shm_name != NULL) shm_unlink(config->shm_name);
+		return NULL;
+	}
+	register_heap(heap);
+	if(!prepare_heap_pages(heap, config->flags)){
+		my_heap_destroy(heap);
+		return NULL;
+	}
+	start_maintenance(heap, config);
+	return heap;
+}
+
+my_heap_t* my_heap_attach_fd(int fd){
+	struct stat st;
+	char* base_ptr;
+	my_heap_t* heap;
+	heap_meta* meta;
+	if(fstat(fd, &st) != 0 || (size_t) st.st_size < PAGE_SIZE) return NULL;
+	base_ptr = (char*) mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base_ptr == MAP_FAILED) return NULL;
+	meta = (heap_meta*) base_ptr;
+	if(meta->magic != HEAP_MAGIC || meta->total_size != (size_t) st.st_size || !(meta->flags & MY_HEAP_SHARED)){
+		munmap(base_ptr, (size_t) st.st_size);
+		return NULL;
+	}
+	heap = new_heap_handle(base_ptr, (size_t) st.st_size, fd, FALSE, meta->flags);
+	if(heap == NULL){
+		munmap(base_ptr, (size_t) st.st_size);
+		return NULL;
+	}
+	heap->segments = (segment*) OFFSET_TO_PTR(base_ptr, meta->segments);
+	register_heap(heap);
+	return heap;
+}
+
+my_heap_t* my_heap_attach(const char* shm_name){
+	my_heap_t* heap;
+	int fd;
+	assert(shm_name != NULL);
+	fd = shm_open(shm_name, O_RDWR, 0600);
+	if(fd < 0) return NULL;
+	heap = my_heap_attach_fd(fd);
+	if(heap == NULL) close(fd);
+	return heap;
+}
+
+int my_heap_fd(my_heap_t* heap){
+	assert(heap != NULL);
+	return heap->fd;
+}
+
+size_t my_heap_ptr_to_offset(my_heap_t* heap, void* ptr){
+	assert(heap != NULL);
+	assert(ptr == NULL || ((char*) ptr > heap->base_ptr && (char*) ptr < heap->base_ptr + heap->mapping_size));
+	return PTR_TO_OFFSET(heap->base_ptr, ptr);
+}
+
+void* my_heap_offset_to_ptr(my_heap_t* heap, size_t offset){
+	assert(heap != NULL);
+	assert(offset < heap->mapping_size);
+	return OFFSET_TO_PTR(heap->base_ptr, offset);
+}
+
+void my_heap_set_root(my_heap_t* heap, void* ptr){
+	assert(heap != NULL);
+	heap->meta->root = PTR_TO_OFFSET(heap->base_ptr, ptr);
+}
+
+void* my_heap_get_root(my_heap_t* heap){
+	assert(heap != NULL);
+	return OFFSET_TO_PTR(heap->base_ptr, heap->meta->root);
+}
+
+int my_heap_is_relocated(my_heap_t* heap){
+	assert(heap != NULL);
+	return heap->relocated;
+}
+
+int my_heap_sync(my_heap_t* heap){
+	assert(heap != NULL);
+	if(heap->fd < 0) return 0;
+	return msync(heap->base_ptr, heap->mapping_size, MS_SYNC);
+}
+
+/*
+ * Work of one prefault thread: the segments first, first + stride, ... of a heap,
+ * each from its start up to the share of the requested bytes that falls on it.
+ */
+typedef struct prefault_job{
+	my_heap_t* heap;
+	size_t bytes;
+	int first;
+	int stride;
+} prefault_job;
+
+/*
+ * Faults in the pages of [start, start + length) for writing without changing their contents.
+ */
+void prefault_range(char* start, size_t length){
+	char* page;
+#ifdef MADV_POPULATE_WRITE
+	if(madvise(start, length, MADV_POPULATE_WRITE) == 0) return;
+#endif
+	/* Kernels before 5.14: an atomic add of 0 takes a write fault but cannot lose a concurrent store */
+	for(page = start; page < start + length; page += PAGE_SIZE) __sync_fetch_and_add(page, 0);
+}
+
+void* prefault_segments(void* arg){
+	prefault_job* job = (prefault_job*) arg;
+	heap_meta* meta = job->heap->meta;
+	int i;
+	for(i = job->first; i < meta->num_segments; i += job->stride){
+		segment* seg = job->heap->segments + i;
+		size_t length = seg->size;
+		char* start = (char*) ALIGN_DOWN((size_t) OFFSET_TO_PTR(job->heap->base_ptr, seg->start), PAGE_SIZE);
+		/* Blocks are placed from the bottom of a segment, so its start is used first */
+		if(job->bytes > 0 && job->bytes < meta->capacity) length = (size_t) ((double) job->bytes * seg->size / meta->capacity);
+		length = ALIGN_UP(length, PAGE_SIZE);
+		if((char*) OFFSET_TO_PTR(job->heap->base_ptr, seg->start) + length > job->heap->base_ptr + job->heap->mapping_size){
+			length = (size_t) (job->heap->base_ptr + job->heap->mapping_size - start);
+		}
+		if(length > 0) prefault_range(start, length);
+	}
+	return NULL;
+}
+
+void my_heap_prefault(my_heap_t* heap, size_t bytes){
+	prefault_job jobs[MAX_SMALL_SEGMENTS + NUM_MEDIUM_SEGMENTS + 1];
+	pthread_t threads[MAX_SMALL_SEGMENTS + NUM_MEDIUM_SEGMENTS + 1];
+	bool started[MAX_SMALL_SEGMENTS + NUM_MEDIUM_SEGMENTS + 1];
+	long num_cpus;
+	int num_jobs;
+	int i;
+	assert(heap != NULL);
+	/* The heap metadata in front of the segments is touched by every allocation */
+	prefault_range(heap->base_ptr, heap->meta->data);
+	/* One thread per CPU faults in its share of the segments in parallel */
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_jobs = num_cpus < 1 ? 1 : num_cpus < heap->meta->num_segments ? (int) num_cpus : heap->meta->num_segments;
+	for(i = 0; i < num_jobs; i++){
+		jobs[i].heap = heap;
+		jobs[i].bytes = bytes;
+		jobs[i].first = i;
+		jobs[i].stride = num_jobs;
+		started[i] = i > 0 && pthread_create(threads + i, NULL, prefault_segments, jobs + i) == 0;
+		/* Segments of a thread that could not be started are faulted in by the caller */
+		if(i > 0 && !started[i]) prefault_segments(jobs + i);
+	}
+	prefault_segments(jobs);
+	for(i = 1; i < num_jobs; i++){
+		if(started[i]) pthread_join(threads[i], NULL);
+	}
+}
+
+/*
+ * Returns the whole pages between start and end to the kernel. Their contents read as zeros afterwards.
+ * Private mappings are dropped with MADV_DONTNEED; shared and file-backed mappings need MADV_REMOVE to free their pages.
+ * Locked heaps keep their pages resident on purpose.
+ */
+void release_pages(my_heap_t* heap, char* start, char* end){
+	if(heap->meta->flags & MY_HEAP_LOCKED) return;
+	start = (char*) ALIGN_UP((size_t) start, PAGE_SIZE);
+	end = (char*) ALIGN_DOWN((size_t) end, PAGE_SIZE);
+	if(end <= start) return;
+	madvise(start, (size_t) (end - start), is_mapping_shared(heap) ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+/*
+ * Returns the pages of a segment's free space (everything after its first block header, or after the bitmaps of
+ * a buddy segment, up to its fence) to the kernel.
+ */
+void release_segment_pages(my_heap_t* heap, segment* seg){
+	heap_offset first = seg->policy == MY_HEAP_POLICY_BUDDY ? seg->buddy_start : seg->start + sizeof(block_header);
+	release_pages(heap, heap->base_ptr + first, heap->base_ptr + seg->start + seg->size - sizeof(block_header));
+}
+
+/*
+ * Returns the pages of a free block's payload to the kernel, except for the tree links at its start.
+ */
+void release_free_block_pages(my_heap_t* heap, block_header* block){
+	release_pages(heap, (char*) TREE_LINKS(block) + sizeof(tree_links), (char*) block + sizeof(block_header) + block->size);
+}
+
+/*
+ * Releases the pages of every free block of a segment, including those of its borrowed regions.
+ * Called with the segment lock held.
+ */
+void purge_segment(my_heap_t* heap, segment* seg){
+	block_header* block;
+	block_header* loan;
+	int order;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY){
+		for(order = 0; order < seg->buddy_orders; order++){
+			for(block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->buddy_free[order]); block != NULL; block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, block->next)){
+				release_free_block_pages(heap, block);
+			}
+		}
+		return;
+	}
+	for(block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->start); !(block->flags & BLOCK_FENCE); block = NEXT_BLOCK(block)){
+		if(block->free) release_free_block_pages(heap, block);
+	}
+	for(loan = (block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->loans); loan != NULL; loan = (block_header*) OFFSET_TO_PTR(heap->base_ptr, loan->next)){
+		for(block = loan + 1; !(block->flags & BLOCK_FENCE); block = NEXT_BLOCK(block)){
+			if(block->free) release_free_block_pages(heap, block);
+		}
+	}
+}
+
+/*
+ * One pass of the maintenance thread. A segment that saw no allocation or free since the previous
+ * pass has its free pages released, once per idle period, so busy segments keep their warm pages.
+ * A retuning requested by an allocation is carried out here instead of on the allocating thread.
+ */
+void run_maintenance(my_heap_t* heap){
+	int i;
+	for(i = 0; i < heap->meta->num_segments; i++){
+		segment* seg = heap->segments + i;
+		pthread_mutex_lock(&seg->lock);
+		if(seg->activity != seg->maintained_activity){
+			seg->maintained_activity = seg->activity;
+			seg->purged = FALSE;
+		}else if(!seg->purged){
+			purge_segment(heap, seg);
+			seg->purged = TRUE;
+		}
+		pthread_mutex_unlock(&seg->lock);
+	}
+	if(__sync_lock_test_and_set(&heap->tune_pending, FALSE)) my_heap_tune(heap);
+}
+
+/*
+ * Returns the payload size of the largest free block of a segment, including its borrowed regions,
+ * from the segment's free structure: the highest buddy order, the rightmost tree node or the head of
+ * the highest TLSF list (which may be up to one list range below the largest block), or a walk of
+ * the free list, which costs no more than one best-fit search. Called with the segment lock held.
+ */
+size_t largest_free_block(my_heap_t* heap, segment* seg){
+	block_header* block;
+	size_t largest = 0;
+	int order;
+	if(seg->policy == MY_HEAP_POLICY_BUDDY){
+		for(order = seg->buddy_orders - 1; order >= 0; order--){
+			if(seg->buddy_free[order] != NULL_OFFSET) return (BUDDY_MIN_BLOCK << order) - sizeof(block_header);
+		}
+		return 0;
+	}
+	if(seg->policy == MY_HEAP_POLICY_INDEXED){
+		block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->free_list);
+		if(block == NULL) return 0;
+		while(TREE_RIGHT(heap->base_ptr, block) != NULL) block = TREE_RIGHT(heap->base_ptr, block);
+		return block->size;
+	}
+	if(seg->policy == MY_HEAP_POLICY_TLSF){
+		tlsf_table* table = (tlsf_table*) OFFSET_TO_PTR(heap->base_ptr, seg->tlsf);
+		int fl;
+		if(table->fl_bitmap == 0) return 0;
+		fl = floor_log2(table->fl_bitmap);
+		block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, table->heads[fl][floor_log2(table->sl_bitmap[fl])]);
+		return block->size;
+	}
+	for(block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->free_list); block != NULL; block = (block_header*) OFFSET_TO_PTR(heap->base_ptr, block->next)){
+		if(block->size > largest) largest = block->size;
+	}
+	return largest;
+}
+
+/*
+ * Writes one latency histogram in the Prometheus text format, with buckets in seconds.
+ */
+void write_latency_histogram(FILE* file, const char* name, const char* help, const unsigned long* histogram, unsigned long total_ns){
+	unsigned long count = 0;
+	int bucket;
+	fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+		count += histogram[bucket];
+		fprintf(file, "%s_bucket{le=\"%.9f\"} %lu\n", name, (double) (1UL << (bucket + LATENCY_MIN_SHIFT)) / 1e9, count);
+	}
+	count += histogram[LATENCY_BUCKETS];
+	fprintf(file, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n", name, count, name, total_ns / 1e9, name, count);
+}
+
+int my_heap_write_stats(my_heap_t* heap, const char* path){
+	/* Per-segment values are read together under each segment lock */
+	static const char* names[] = {"capacity_bytes", "bytes_in_use", "largest_free_block_bytes", "lock_acquisitions_total", "lock_contended_total", "waits_total", "wait_timeouts_total"};
+	static const char* helps[] = {
+		"Size of the segment.",
+		"Bytes of the blocks allocated from the segment, including their headers.",
+		"Payload size of the largest free block of the segment (for TLSF segments, to within one list range).",
+		"Segment lock acquisitions on the allocation and free paths.",
+		"Segment lock acquisitions that found the lock taken.",
+		"Allocations that waited for a block to be freed in the segment.",
+		"Waits for a free block that timed out."};
+	static const char* tiers[] = {"small", "medium", "large"};
+	unsigned long values[MAX_SMALL_SEGMENTS + NUM_MEDIUM_SEGMENTS + 1][7];
+	char* tmp_path;
+	FILE* file;
+	int num_segments;
+	int metric;
+	int i;
+	assert(heap != NULL && path != NULL);
+	num_segments = heap->meta->num_segments;
+	for(i = 0; i < num_segments; i++){
+		segment* seg = heap->segments + i;
+		pthread_mutex_lock(&seg->lock);
+		values[i][0] = seg->size;
+		values[i][1] = seg->bytes_in_use;
+		values[i][2] = largest_free_block(heap, seg);
+		values[i][3] = seg->lock_acquisitions;
+		values[i][4] = seg->lock_contended;
+		values[i][5] = seg->waits;
+		values[i][6] = seg->wait_timeouts;
+		pthread_mutex_unlock(&seg->lock);
+	}
+	/* Collectors must never see a partial file, so it is written aside and renamed into place */
+	tmp_path = (char*) malloc(strlen(path) + 5);
+	if(tmp_path == NULL) return -1;
+	sprintf(tmp_path, "%s.tmp", path);
+	file = fopen(tmp_path, "w");
+	if(file == NULL){
+		free(tmp_path);
+		return -1;
+	}
+	fprintf(file, "# HELP my_heap_capacity_bytes Bytes of the heap available to its segments.\n# TYPE my_heap_capacity_bytes gauge\nmy_heap_capacity_bytes %lu\n", (unsigned long) heap->meta->capacity);
+	fprintf(file, "# HELP my_heap_bytes_in_use Bytes allocated from the heap, including headers and huge blocks.\n# TYPE my_heap_bytes_in_use gauge\nmy_heap_bytes_in_use %lu\n", (unsigned long) heap->meta->bytes_in_use);
+	for(metric = 0; metric < 7; metric++){
+		fprintf(file, "# HELP my_heap_segment_%s %s\n# TYPE my_heap_segment_%s %s\n", names[metric], helps[metric], names[metric], metric < 3 ? "gauge" : "counter");
+		for(i = 0; i < num_segments; i++){
+			int tier = i < heap->meta->num_small_segments ? 0 : i < LARGE_SEGMENT(heap->meta) ? 1 : 2;
+			fprintf(file, "my_heap_segment_%s{segment=\"%d\",tier=\"%s\"} %lu\n", names[metric], i, tiers[tier], values[i][metric]);
+		}
+	}
+	write_latency_histogram(file, "my_heap_malloc_latency_seconds", "Time taken by allocations while statistics are exported.", heap->malloc_latency, heap->malloc_latency_ns);
+	write_latency_histogram(file, "my_heap_free_latency_seconds", "Time taken by frees while statistics are exported.", heap->free_latency, heap->free_latency_ns);
+	if(fclose(file) != 0 || rename(tmp_path, path) != 0){
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+	return 0;
+}
+
+/*
+ * Moves a point in time forward by the given number of milliseconds.
+ */
+void add_milliseconds(struct timespec* time, unsigned long milliseconds){
+	time->tv_sec += (time_t) (milliseconds / 1000);
+	time->tv_nsec += (long) (milliseconds % 1000) * 1000000L;
+	if(time->tv_nsec >= 1000000000L){
+		time->tv_sec++;
+		time->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Returns TRUE if time a is not later than time b.
+ */
+bool is_due(const struct timespec* a, const struct timespec* b){
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec <= b->tv_nsec);
+}
+
+/*
+ * Runs the maintenance passes and the statistics export of a heap, each on its own interval.
+ */
+void* maintenance_thread(void* arg){
+	my_heap_t* heap = (my_heap_t*) arg;
+	struct timespec now;
+	struct timespec next_maintenance;
+	struct timespec next_export;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &now);
+	next_maintenance = now;
+	add_milliseconds(&next_maintenance, heap->maintenance_interval);
+	next_export = now;
+	add_milliseconds(&next_export, heap->stats_interval);
+	pthread_mutex_lock(&heap->maintenance_mutex);
+	while(!heap->maintenance_stop){
+		if(heap->maintenance_interval == 0) deadline = next_export;
+		else if(heap->stats_path == NULL || is_due(&next_maintenance, &next_export)) deadline = next_maintenance;
+		else deadline = next_export;
+		if(pthread_cond_timedwait(&heap->maintenance_condition, &heap->maintenance_mutex, &deadline) != ETIMEDOUT) continue;
+		pthread_mutex_unlock(&heap->maintenance_mutex);
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(heap->maintenance_interval > 0 && is_due(&next_maintenance, &now)){
+			run_maintenance(heap);
+			next_maintenance = now;
+			add_milliseconds(&next_maintenance, heap->maintenance_interval);
+		}
+		if(heap->stats_path != NULL && is_due(&next_export, &now)){
+			my_heap_write_stats(heap, heap->stats_path);
+			next_export = now;
+			add_milliseconds(&next_export, heap->stats_interval);
+		}
+		pthread_mutex_lock(&heap->maintenance_mutex);
+	}
+	pthread_mutex_unlock(&heap->maintenance_mutex);
+	return NULL;
+}
+
+/*
+ * Starts the maintenance thread of a heap if maintenance or a statistics export is configured.
+ * Without a thread the heap simply keeps doing its work inline. Real-time heaps get no maintenance passes.
+ */
+void start_maintenance(my_heap_t* heap, const my_heap_config_t* config){
+	if(config->stats_path != NULL && config->stats_interval > 0){
+		heap->stats_path = (char*) malloc(strlen(config->stats_path) + 1);
+		if(heap->stats_path != NULL) strcpy(heap->stats_path, config->stats_path);
+		heap->stats_interval = config->stats_interval;
+	}
+	/* A purge walks a segment's blocks under its lock, which a real-time allocation must never wait for */
+	heap->maintenance_interval = (heap->meta->flags & MY_HEAP_REALTIME) ? 0 : config->maintenance_interval;
+	if(heap->maintenance_interval == 0 && heap->stats_path == NULL) return;
+	heap->maintenance_running = pthread_create(&heap->maintenance_thread, NULL, maintenance_thread, heap) == 0;
+}
+
+/*
+ * Stops the maintenance thread of a heap and waits for its current pass to finish.
+ */
+void stop_maintenance(my_heap_t* heap){
+	if(!heap->maintenance_running) return;
+	pthread_mutex_lock(&heap->maintenance_mutex);
+	heap->maintenance_stop = TRUE;
+	pthread_cond_signal(&heap->maintenance_condition);
+	pthread_mutex_unlock(&heap->maintenance_mutex);
+	pthread_join(heap->maintenance_thread, NULL);
+	heap->maintenance_running = FALSE;
+	heap->maintenance_stop = FALSE;
+}
+
+void my_heap_reset(my_heap_t* heap, int flags){
+	pressure_event event;
+	thread_state* state;
+	int i;
+	assert(heap != NULL);
+	/* The immortal mutex comes before the segment locks, as in prepare_fork() */
+	pthread_mutex_lock(&heap->immortal_mutex);
+	for(i = 0; i < heap->meta->num_segments; i++){
+		pthread_mutex_lock(&((heap->segments + i)->lock));
+	}
+	heap->immortal_chunk = NULL;
+	heap->immortal_bump = NULL;
+	heap->immortal_end = NULL;
+	heap->immortal_allocated = 0;
+	for(i = 0; i < heap->meta->num_segments; i++){
+		if(flags & MY_HEAP_RESET_RELEASE_PAGES) release_segment_pages(heap, heap->segments + i);
+		initialize_segment_blocks(heap->base_ptr, heap->segments + i, i);
+	}
+	heap->meta->root = NULL_OFFSET;
+	event = update_heap_usage(heap->meta, heap->meta->bytes_in_use, FALSE);
+	/* Every tag's allocations are gone too */
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	memset(heap->meta->tag_bytes, 0, sizeof(heap->meta->tag_bytes));
+	for(state = heap->thread_states; state != NULL; state = state->next_state){
+		memset(state->tag_delta, 0, sizeof(state->tag_delta));
+		/* Thread chunks and scope stacks were reclaimed with everything else */
+		state->chunk = NULL;
+		state->bump = NULL;
+		state->bump_end = NULL;
+		state->chunk_allocated = 0;
+		state->scope_chunk = NULL;
+		state->scope_top = NULL;
+		state->scope_end = NULL;
+		state->scope_frame = NULL;
+		state->scope_spare = NULL;
+	}
+	heap->orphans = NULL;
+	heap->num_orphans = 0;
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	for(i = heap->meta->num_segments - 1; i >= 0; i--){
+		pthread_cond_broadcast(&((heap->segments + i)->condition));
+		pthread_mutex_unlock(&((heap->segments + i)->lock));
+	}
+	pthread_mutex_unlock(&heap->immortal_mutex);
+	/* Huge blocks are dropped as well; their bytes were part of the usage cleared above */
+	pthread_mutex_lock(&heap->huge_mutex);
+	while(heap->huge_blocks != NULL){
+		huge_header* huge = heap->huge_blocks;
+		heap->huge_blocks = huge->next;
+		munmap(huge, huge->mapping_size);
+	}
+	pthread_mutex_unlock(&heap->huge_mutex);
+	notify_pressure(heap, event);
+}
+
+/*
+ * Lends part of the large segment to a small segment that ran out of room. A block of at least
+ * loan_size bytes is taken from the large segment and formed into an extra region of the small
+ * segment, with its own first block and fence, which goes back once all of it is free again.
+ * Returns a block of size bytes taken from the segment (from the top if top is set, with the
+ * segment lock held), or NULL if the segment cannot borrow or the large segment has no room.
+ */
+block_header* borrow_capacity(my_heap_t* heap, int seg_id, size_t size, bool top){
+	heap_meta* meta = heap->meta;
+	segment* seg = heap->segments + seg_id;
+	segment* lender = heap->segments + LARGE_SEGMENT(meta);
+	size_t loan_size = meta->loan_size;
+	size_t needed = size;
+	block_header* loan;
+	block_header* first;
+	block_header* fence;
+	block_header* block;
+	pressure_event lender_event;
+	if(loan_size == 0 || seg_id == LARGE_SEGMENT(meta) || seg->policy == MY_HEAP_POLICY_BUDDY) return NULL;
+	/* A TLSF search skips blocks below the rounded request, so the region must hold that much */
+	if(seg->policy == MY_HEAP_POLICY_TLSF) needed = tlsf_round(size);
+	/* loan_size includes the header of the lent block, so that a buddy lender hands out exact powers of two */
+	if(loan_size < needed + 3 * sizeof(block_header)) loan_size = needed + 3 * sizeof(block_header);
+	loan_size = ALIGN_UP(loan_size, ALIGNMENT);
+	pthread_mutex_lock(&lender->lock);
+	loan = take_free_block(heap->base_ptr, lender, loan_size - sizeof(block_header), FALSE);
+	if(loan == NULL){
+		pthread_mutex_unlock(&lender->lock);
+		return NULL;
+	}
+	/* The lent bytes count towards the large segment, but not again towards the heap */
+	loan->free = FALSE;
+	loan->requested_size = loan->size;
+	loan->tag = MY_HEAP_NO_TAG;
+	lender_event = update_segment_usage(meta, lender, LARGE_SEGMENT(meta), loan->size + sizeof(block_header), TRUE);
+	pthread_mutex_unlock(&lender->lock);
+	notify_pressure(heap, lender_event);
+	/* The region is private until it is linked into the segment */
+	first = (block_header*) ((char*) loan + sizeof(block_header));
+	first->size = loan->size - 2 * sizeof(block_header);
+	first->prev_size = 0;
+	first->requested_size = 0;
+	first->tag = MY_HEAP_NO_TAG;
+	first->kind = KIND_BLOCK;
+	first->free = TRUE;
+	first->flags = BLOCK_FIRST | BLOCK_BORROWED;
+	first->segment_id = seg_id;
+	fence = NEXT_BLOCK(first);
+	fence->size = 0;
+	fence->prev_size = first->size;
+	fence->next = NULL_OFFSET;
+	fence->prev = NULL_OFFSET;
+	fence->requested_size = 0;
+	fence->tag = MY_HEAP_NO_TAG;
+	fence->kind = KIND_BLOCK;
+	fence->free = FALSE;
+	fence->flags = BLOCK_FENCE;
+	fence->segment_id = seg_id;
+	pthread_mutex_lock(&seg->lock);
+	loan->prev = NULL_OFFSET;
+	loan->next = seg->loans;
+	if(seg->loans != NULL_OFFSET) ((block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->loans))->prev = PTR_TO_OFFSET(heap->base_ptr, loan);
+	seg->loans = PTR_TO_OFFSET(heap->base_ptr, loan);
+	insert_free_block(heap->base_ptr, seg, first);
+	block = take_free_block(heap->base_ptr, seg, size, top);
+	if(block == NULL){
+		/* The segment's policy passed over the region; detach it and give it back unused */
+		unlink_free_block(heap->base_ptr, seg, first);
+		seg->loans = loan->next;
+		if(seg->loans != NULL_OFFSET) ((block_header*) OFFSET_TO_PTR(heap->base_ptr, seg->loans))->prev = NULL_OFFSET;
+		pthread_mutex_unlock(&seg->lock);
+		give_back_loan(heap, loan);
+	}
+	return block;
+}
+
+/*
+ * Gives a block lent by the large segment back once the region formed from it is empty.
+ */
+void give_back_loan(my_heap_t* heap, block_header* loan){
+	segment* lender = heap->segments + LARGE_SEGMENT(heap->meta);
+	pressure_event lender_event;
+	pthread_mutex_lock(&lender->lock);
+	lender_event = update_segment_usage(heap->meta, lender, LARGE_SEGMENT(heap->meta), loan->size + sizeof(block_header), FALSE);
+	return_free_block(heap->base_ptr, lender, loan);
+	pthread_cond_broadcast(&lender->condition);
+	pthread_mutex_unlock(&lender->lock);
+	notify_pressure(heap, lender_event);
+}
+
+/*
+ * Allocates a block of size bytes (already rounded and aligned) and marks it as allocated.
+ * The block comes from the small, medium or large tier depending on its size: from seg_id if that
+ * segment belongs to the tier, otherwise from the tier's next segment in round robin order.
+ * If it does not fit, a small segment first borrows a region from the large segment, then the
+ * allocation waits for the other segments of the tier (and the large segment for medium blocks).
+ * Thread chunks (BLOCK_CHUNK) are not recorded in the request histogram, and long-lived blocks
+ * (BLOCK_LONG_LIVED) are carved from the top of the segment's free space.
+ * Returns NULL if no block becomes available. The caller accounts the block to its tag.
+ */
+block_header* allocate_block(my_heap_t* heap, size_t size, size_t requested_size, int tag, int seg_id, unsigned char block_flags){
+	segment* segments = heap->segments;
+	heap_meta* meta = heap->meta;
+	block_header* block;
+	int first_segment;
+	int num_tier_segments;
+	bool tune_due = FALSE;
+	bool top = (block_flags & BLOCK_LONG_LIVED) != 0;
+	pressure_event segment_event;
+	int i;
+	/* Route the request to the small, medium or large tier by size */
+	if(size > meta->tuning.large_size){
+		first_segment = LARGE_SEGMENT(meta);
+		num_tier_segments = 1;
+	}else if(meta->num_medium_segments > 0 && size > meta->tuning.medium_size){
+		first_segment = meta->num_small_segments;
+		num_tier_segments = meta->num_medium_segments;
+	}else{
+		first_segment = 0;
+		num_tier_segments = meta->num_small_segments;
+	}
+	if(first_segment == LARGE_SEGMENT(meta)){
+		seg_id = first_segment;
+	}else if(seg_id >= first_segment && seg_id < first_segment + num_tier_segments){
+		/* The caller's segment belongs to the tier */
+	}else if(meta->segment_selection == MY_HEAP_SELECT_CPU){
+		/* Only threads running on the same CPU (or CPUs sharing a segment) compete for the segment */
+		seg_id = first_segment + current_cpu() % num_tier_segments;
+	}else{
+		/* Use round robin allocation within the small and the medium tier */
+		pthread_mutex_lock(&heap->round_robin_mutex);
+		if(first_segment == 0){
+			seg_id = heap->current_segment;
+			heap->current_segment = (heap->current_segment + 1) % meta->num_small_segments;
+		}else{
+			seg_id = first_segment + heap->current_medium_segment;
+			heap->current_medium_segment = (heap->current_medium_segment + 1) % num_tier_segments;
+		}
+		pthread_mutex_unlock(&heap->round_robin_mutex);
+	}
+
+	lock_segment(segments + seg_id);
+	if(!(block_flags & BLOCK_CHUNK)) tune_due = record_request(heap->meta, segments + seg_id, requested_size);
+	/* Retuning is left to the maintenance thread if there is one */
+	if(tune_due && heap->maintenance_running){
+		heap->tune_pending = TRUE;
+		tune_due = FALSE;
+	}
+	block = take_free_block(heap->base_ptr, segments + seg_id, size, top);
+	if(block == NULL){
+		/* Release the current segment lock before checking all segments */
+		pthread_mutex_unlock(&((segments + seg_id)->lock));
+		if(tune_due){
+			my_heap_tune(heap);
+			tune_due = FALSE;
+		}
+		/* Move capacity from the large segment to where the demand is */
+		block = borrow_capacity(heap, seg_id, size, top);
+	}
+	if(block == NULL){
+		/* Give the application a chance to shed memory before waiting or failing */
+		if(heap->num_callbacks > 0){
+			pressure_event critical;
+			critical.level = MY_HEAP_PRESSURE_CRITICAL;
+			critical.segment_id = seg_id;
+			critical.bytes_in_use = (segments + seg_id)->bytes_in_use;
+			critical.capacity = (segments + seg_id)->size;
+			notify_pressure(heap, critical);
+		}
+		/* If no suitable block is found, wait for a free block in each segment of the tier
+		 * Medium requests finally spill over into the large segment */
+		if(first_segment == meta->num_small_segments && first_segment != LARGE_SEGMENT(meta)) num_tier_segments++;
+		for(i = first_segment; i < first_segment + num_tier_segments; i++){
+			block = wait_for_free_block(heap->base_ptr, segments + i, size, top);
+			if(block != NULL){
+				seg_id = i;
+				break;
+			}
+		}
+		if(block == NULL){
+			return NULL;
+		}
+	}
+	/* Mark the block as allocated */
+	(segments + seg_id)->activity++;
+	block->free = FALSE;
+	block->requested_size = requested_size;
+	block->tag = (unsigned short) tag;
+	block->flags |= block_flags;
+	segment_event = update_segment_usage(heap->meta, segments + seg_id, seg_id, block->size + sizeof(block_header), TRUE);
+	pthread_mutex_unlock(&((segments + seg_id)->lock));
+	notify_pressure(heap, segment_event);
+	notify_pressure(heap, update_heap_usage(heap->meta, block->size + sizeof(block_header), TRUE));
+	if(tune_due) my_heap_tune(heap);
+	return block;
+}
+
+/*
+ * Returns an allocated block to its segment's free list and coalesces it with free neighbours.
+ * Thread chunks are not accounted to a tag; their objects were accounted individually.
+ */
+void free_block(my_heap_t* heap, block_header* hdr){
+	segment* seg;
+	int seg_id;
+	size_t bytes;
+	int tag;
+	bool chunk;
+	block_header* loan;
+	pressure_event segment_event;
+	assert(!hdr->free);
+	/* Must be stored in the header */
+	seg_id = hdr->segment_id;
+	seg = heap->segments + seg_id;
+	lock_segment(seg);
+	bytes = hdr->size + sizeof(block_header);
+	tag = hdr->tag;
+	chunk = (hdr->flags & BLOCK_CHUNK) != 0;
+	segment_event = update_segment_usage(heap->meta, seg, seg_id, bytes, FALSE);
+	seg->activity++;
+	hdr->flags &= ~(BLOCK_CHUNK | BLOCK_LONG_LIVED);
+	loan = return_free_block(heap->base_ptr, seg, hdr);
+	pthread_cond_broadcast(&seg->condition);
+	pthread_mutex_unlock(&seg->lock);
+	if(loan != NULL) give_back_loan(heap, loan);
+	notify_pressure(heap, segment_event);
+	notify_pressure(heap, update_heap_usage(heap->meta, bytes, FALSE));
+	if(!chunk) account_tag(heap, tag, bytes, FALSE);
+}
+
+/*
+ * Detaches a thread's current chunk and hands the objects it allocated from it over to the
+ * chunk's balance. If all of them have already been freed, the chunk goes back to its segment.
+ */
+void retire_chunk(my_heap_t* heap, thread_state* state){
+	chunk_header* chunk = state->chunk;
+	long allocated = state->chunk_allocated;
+	if(chunk == NULL) return;
+	state->chunk = NULL;
+	state->bump = NULL;
+	state->bump_end = NULL;
+	state->chunk_allocated = 0;
+	if(__sync_add_and_fetch(&chunk->balance, allocated) == 0){
+		free_block(heap, (block_header*) chunk - 1);
+	}
+}
+
+/*
+ * Parks an exiting thread's chunk in the heap's orphan pool if it can still hold an object of
+ * bump_max_size bytes, so that its rest is not stranded until all of its objects are freed.
+ * The chunk is retired instead if it is full or the pool already holds MAX_ORPHAN_CHUNKS.
+ */
+void orphan_thread_chunk(my_heap_t* heap, thread_state* state){
+	chunk_header* chunk = state->chunk;
+	orphan_chunk* orphan = (orphan_chunk*) state->bump;
+	bool empty = FALSE;
+	if(chunk == NULL) return;
+	if((size_t) (state->bump_end - state->bump) >= sizeof(bump_header) + ALIGN_UP(heap->meta->bump_max_size, ALIGNMENT)){
+		pthread_mutex_lock(&heap->thread_state_mutex);
+		if(heap->num_orphans < MAX_ORPHAN_CHUNKS){
+			state->chunk = NULL;
+			state->bump = NULL;
+			state->bump_end = NULL;
+			if(__sync_add_and_fetch(&chunk->balance, state->chunk_allocated + ORPHAN_BIAS) == ORPHAN_BIAS){
+				empty = TRUE;
+			}else{
+				orphan->chunk = chunk;
+				orphan->next = heap->orphans;
+				heap->orphans = orphan;
+				heap->num_orphans++;
+			}
+			state->chunk_allocated = 0;
+			pthread_mutex_unlock(&heap->thread_state_mutex);
+			if(empty) free_block(heap, (block_header*) chunk - 1);
+			return;
+		}
+		pthread_mutex_unlock(&heap->thread_state_mutex);
+	}
+	retire_chunk(heap, state);
+}
+
+/*
+ * Called by the free that emptied a parked chunk: takes the chunk out of the orphan pool and
+ * returns it to its segment, unless a thread adopted it in the meantime.
+ */
+void release_orphan_chunk(my_heap_t* heap, chunk_header* chunk){
+	orphan_chunk** link;
+	bool found = FALSE;
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	for(link = &heap->orphans; *link != NULL; link = &(*link)->next){
+		if((*link)->chunk == chunk){
+			*link = (*link)->next;
+			heap->num_orphans--;
+			found = TRUE;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	if(found) free_block(heap, (block_header*) chunk - 1);
+}
+
+/*
+ * Takes over a chunk from the orphan pool: the thread continues bump allocating where the exited
+ * owner stopped and becomes the chunk's owner, with the objects still outstanding as its count.
+ * Returns FALSE if the pool is empty.
+ */
+bool adopt_orphan_chunk(my_heap_t* heap, thread_state* state){
+	orphan_chunk* orphan;
+	chunk_header* chunk;
+	long balance;
+	/* Unlocked peek: most refills find the pool empty */
+	if(heap->orphans == NULL) return FALSE;
+	pthread_mutex_lock(&heap->thread_state_mutex);
+	orphan = heap->orphans;
+	if(orphan != NULL){
+		heap->orphans = orphan->next;
+		heap->num_orphans--;
+	}
+	pthread_mutex_unlock(&heap->thread_state_mutex);
+	if(orphan == NULL) return FALSE;
+	chunk = orphan->chunk;
+	/* Concurrent frees keep decrementing, so swap the balance for the owner's starting point of 0 */
+	do{
+		balance = chunk->balance;
+	}while(!__sync_bool_compare_and_swap(&chunk->balance, balance, 0));
+	state->chunk = chunk;
+	state->chunk_allocated = balance - ORPHAN_BIAS;
+	state->bump = (char*) orphan;
+	state->bump_end = (char*) chunk + chunk->size;
+	return TRUE;
+}
+
+/*
+ * Retires a thread's current chunk and adopts an orphaned chunk, or else carves a new one from its home segment.
+ * Returns FALSE if no chunk could be allocated.
+ */
+bool refill_chunk(my_heap_t* heap, thread_state* state){
+	block_header* block;
+	chunk_header* chunk;
+	size_t chunk_size = ALIGN_UP(heap->meta->bump_chunk_size, ALIGNMENT);
+	retire_chunk(heap, state);
+	if(adopt_orphan_chunk(heap, state)) return TRUE;
+	block = allocate_block(heap, chunk_size, chunk_size, MY_HEAP_NO_TAG, state->home_segment, BLOCK_CHUNK);
+	if(block == NULL) return FALSE;
+	chunk = (chunk_header*) ((char*) block + sizeof(block_header));
+	chunk->balance = 0;
+	chunk->size = block->size;
+	state->chunk = chunk;
+	state->bump = (char*) chunk + sizeof(chunk_header);
+	state->bump_end = (char*) chunk + block->size;
+	state->chunk_allocated = 0;
+	return TRUE;
+}
+
+void* my_heap_malloc(my_heap_t* heap, size_t size){
+	return my_heap_malloc_tagged(heap, size, my_get_thread_tag());
+}
+
+/*
+ * Writes the header of an object of bytes bytes (header included) at bump in a chunk and returns its payload.
+ */
+void* carve_bump_object(chunk_header* chunk, char* bump, size_t bytes, int tag){
+	bump_header* object = (bump_header*) bump;
+	object->size = (unsigned int) bytes;
+	object->chunk_offset = (unsigned int) (bump - (char*) chunk);
+	object->tag = (unsigned short) tag;
+	object->kind = KIND_BUMP;
+	return (void*) (bump + sizeof(bump_header));
+}
+
+/*
+ * Carves a new immortal chunk from the top of a small segment. Called without the immortal mutex,
+ * since the allocation may run pressure callbacks or wait for a free block.
+ * Returns NULL if no chunk could be allocated.
+ */
+chunk_header* new_immortal_chunk(my_heap_t* heap){
+	block_header* block;
+	chunk_header* chunk;
+	size_t chunk_size = ALIGN_UP(heap->meta->bump_chunk_size, ALIGNMENT);
+	block = allocate_block(heap, chunk_size, chunk_size, MY_HEAP_NO_TAG, -1, BLOCK_CHUNK | BLOCK_LONG_LIVED);
+	if(block == NULL) return NULL;
+	chunk = (chunk_header*) ((char*) block + sizeof(block_header));
+	chunk->balance = 0;
+	chunk->size = block->size;
+	return chunk;
+}
+
+/*
+ * Retires the heap's immortal chunk like a thread chunk and installs chunk in its place.
+ * Called with the immortal mutex held. Returns the old chunk if all of its objects have already
+ * been freed, so that the caller frees it once the mutex is released, otherwise NULL.
+ */
+chunk_header* replace_immortal_chunk(my_heap_t* heap, chunk_header* chunk){
+	chunk_header* old = heap->immortal_chunk;
+	long allocated = heap->immortal_allocated;
+	heap->immortal_chunk = chunk;
+	heap->immortal_bump = (char*) chunk + sizeof(chunk_header);
+	heap->immortal_end = (char*) chunk + chunk->size;
+	heap->immortal_allocated = 0;
+	if(old != NULL && __sync_add_and_fetch(&old->balance, allocated) == 0) return old;
+	return NULL;
+}
+
+/*
+ * Allocates a huge block of size bytes for a tag in a private mapping of its own.
+ * Returns the payload or NULL if the mapping fails or the tag is over its quota.
+ */
+void* allocate_huge(my_heap_t* heap, size_t size, int tag){
+	size_t mapping_size = ALIGN_UP(size + sizeof(huge_header), PAGE_SIZE);
+	huge_header* huge;
+	if(exceeds_tag_quota(heap, tag, mapping_size)) return NULL;
+	huge = (huge_header*) mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS
+		| ((heap->meta->flags & MY_HEAP_PREFAULT) ? MAP_POPULATE : 0) | ((heap->meta->flags & MY_HEAP_LOCKED) ? MAP_LOCKED : 0), -1, 0);
+	if(huge == MAP_FAILED) return NULL;
+	huge->mapping_size = mapping_size;
+	huge->requested_size = size;
+	huge->tag = (unsigned short) tag;
+	huge->kind = KIND_HUGE;
+	pthread_mutex_lock(&heap->huge_mutex);
+	huge->prev = NULL;
+	huge->next = heap->huge_blocks;
+	if(heap->huge_blocks != NULL) heap->huge_blocks->prev = huge;
+	heap->huge_blocks = huge;
+	pthread_mutex_unlock(&heap->huge_mutex);
+	notify_pressure(heap, update_heap_usage(heap->meta, mapping_size, TRUE));
+	account_tag(heap, tag, mapping_size, TRUE);
+	return (void*) (huge + 1);
+}
+
+/*
+ * Unmaps a huge block.
+ */
+void free_huge(my_heap_t* heap, huge_header* huge){
+	size_t mapping_size = huge->mapping_size;
+	int tag = huge->tag;
+	pthread_mutex_lock(&heap->huge_mutex);
+	if(huge->prev != NULL) huge->prev->next = huge->next;
+	else heap->huge_blocks = huge->next;
+	if(huge->next != NULL) huge->next->prev = huge->prev;
+	pthread_mutex_unlock(&heap->huge_mutex);
+	munmap(huge, mapping_size);
+	notify_pressure(heap, update_heap_usage(heap->meta, mapping_size, FALSE));
+	account_tag(heap, tag, mapping_size, FALSE);
+}
+
+/*
+ * Resizes a huge block with mremap(), which extends the mapping in place when the following
+ * address space is free and otherwise moves its pages instead of copying bytes.
+ * Returns the (possibly moved) block or NULL if it cannot be resized; the old block is then unchanged.
+ */
+huge_header* resize_huge(my_heap_t* heap, huge_header* huge, size_t size){
+	size_t mapping_size = ALIGN_UP(size + sizeof(huge_header), PAGE_SIZE);
+	size_t old_mapping_size = huge->mapping_size;
+	int tag = huge->tag;
+	huge_header* resized;
+	if(mapping_size > old_mapping_size && exceeds_tag_quota(heap, tag, mapping_size - old_mapping_size)) return NULL;
+	/* The list links of the neighbours are fixed up under the lock if the block moves */
+	pthread_mutex_lock(&heap->huge_mutex);
+	resized = (huge_header*) mremap(huge, old_mapping_size, mapping_size, MREMAP_MAYMOVE);
+	if(resized == MAP_FAILED){
+		pthread_mutex_unlock(&heap->huge_mutex);
+		return NULL;
+	}
+	if(resized->prev != NULL) resized->prev->next = resized;
+	else heap->huge_blocks = resized;
+	if(resized->next != NULL) resized->next->prev = resized;
+	resized->mapping_size = mapping_size;
+	resized->requested_size = size;
+	pthread_mutex_unlock(&heap->huge_mutex);
+	if(mapping_size > old_mapping_size){
+		notify_pressure(heap, update_heap_usage(heap->meta, mapping_size - old_mapping_size, TRUE));
+		account_tag(heap, tag, mapping_size - old_mapping_size, TRUE);
+	}else if(mapping_size < old_mapping_size){
+		notify_pressure(heap, update_heap_usage(heap->meta, old_mapping_size - mapping_size, FALSE));
+		account_tag(heap, tag, old_mapping_size - mapping_size, FALSE);
+	}
+	return resized;
+}
+
+/*
+ * Counts a latency that started at start in a histogram with its sum in nanoseconds.
+ */
+void record_latency(unsigned long* histogram, unsigned long* total_ns, const struct timespec* start){
+	struct timespec end;
+	long ns;
+	int bucket;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+	/* Bucket b counts latencies up to 1 << (b + LATENCY_MIN_SHIFT) nanoseconds */
+	bucket = ns <= (1L << LATENCY_MIN_SHIFT) ? 0 : floor_log2((size_t) (ns - 1)) + 1 - LATENCY_MIN_SHIFT;
+	if(bucket > LATENCY_BUCKETS) bucket = LATENCY_BUCKETS;
+	__sync_fetch_and_add(histogram + bucket, 1);
+	__sync_fetch_and_add(total_ns, (unsigned long) ns);
+}
+
+/*
+ * Allocates an object for a tag, placed according to the lifetime hints (MY_HEAP_HINT_*).
+ * Short-lived and unhinted requests use the thread chunks and the bottom of the segments. Long-lived
+ * requests are carved from the top of the segments instead, and small immortal objects are packed
+ * into a shared immortal chunk, so objects that stay never pin holes among short-lived churn.
+ */
+void* place_object(my_heap_t* heap, size_t size, int tag, int hints){
+	block_header* block;
+	thread_state* state;
+	size_t requested_size = size;
+	bool long_lived = (hints & (MY_HEAP_HINT_LONG_LIVED | MY_HEAP_HINT_IMMORTAL)) != 0;
+	assert(heap != NULL);
+	assert(size > 0);
+	assert(tag >= 0 && tag < MY_HEAP_MAX_TAGS);
+	if(heap->meta->huge_size > 0 && size > heap->meta->huge_size) return allocate_huge(heap, size, tag);
+	if(size <= heap->meta->bump_max_size){
+		size_t bytes = ALIGN_UP(size, ALIGNMENT) + sizeof(bump_header);
+		/* Small immortal objects share one chunk, which is never mixed with other lifetimes */
+		if(hints & MY_HEAP_HINT_IMMORTAL){
+			void* ptr;
+			chunk_header* retired = NULL;
+			if(exceeds_tag_quota(heap, tag, bytes)) return NULL;
+			pthread_mutex_lock(&heap->immortal_mutex);
+			if((size_t) (heap->immortal_end - heap->immortal_bump) < bytes){
+				chunk_header* fresh;
+				pthread_mutex_unlock(&heap->immortal_mutex);
+				fresh = new_immortal_chunk(heap);
+				if(fresh == NULL) return NULL;
+				pthread_mutex_lock(&heap->immortal_mutex);
+				/* Another thread may have installed a chunk in the meantime; the new one is then not needed */
+				if((size_t) (heap->immortal_end - heap->immortal_bump) < bytes) retired = replace_immortal_chunk(heap, fresh);
+				else retired = fresh;
+			}
+			ptr = carve_bump_object(heap->immortal_chunk, heap->immortal_bump, bytes, tag);
+			heap->immortal_bump += bytes;
+			heap->immortal_allocated++;
+			pthread_mutex_unlock(&heap->immortal_mutex);
+			if(retired != NULL) free_block(heap, (block_header*) retired - 1);
+			account_tag(heap, tag, bytes, TRUE);
+			return ptr;
+		}
+		/* Other small requests are bump allocated from the calling thread's chunk without taking a lock */
+		if(!long_lived && (state = get_thread_state(heap)) != NULL){
+			void* ptr;
+			if(exceeds_tag_quota(heap, tag, bytes)) return NULL;
+			if((size_t) (state->bump_end - state->bump) < bytes && !refill_chunk(heap, state)) return NULL;
+			ptr = carve_bump_object(state->chunk, state->bump, bytes, tag);
+			state->bump += bytes;
+			state->chunk_allocated++;
+			account_tag(heap, tag, bytes, TRUE);
+			return ptr;
+		}
+	}
+	/* Round to the heap's size classes and keep every block header and payload aligned */
+	size = ALIGN_UP(round_to_size_class(&heap->meta->tuning, size), ALIGNMENT);
+	/* Over-quota tags fail fast instead of waiting for memory that other tags need */
+	if(exceeds_tag_quota(heap, tag, size + sizeof(block_header))) return NULL;
+	block = allocate_block(heap, size, requested_size, tag, -1, long_lived ? BLOCK_LONG_LIVED : 0);
+	if(block == NULL) return NULL;
+	account_tag(heap, tag, block->size + sizeof(block_header), TRUE);
+	/* Return the pointer to the allocated memory */
+	return (void*) ((char*) block + sizeof(block_header));
+}
+
+/*
+ * Allocates an object for a tag, timing it while the heap exports statistics.
+ */
+void* allocate_object(my_heap_t* heap, size_t size, int tag, int hints){
+	struct timespec start;
+	void* ptr;
+	if(heap->stats_path == NULL) return place_object(heap, size, tag, hints);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ptr = place_object(heap, size, tag, hints);
+	record_latency(heap->malloc_latency, &heap->malloc_latency_ns, &start);
+	return ptr;
+}
+
+void* my_heap_malloc_tagged(my_heap_t* heap, size_t size, int tag){
+	return allocate_object(heap, size, tag, 0);
+}
+
+void* my_heap_malloc_hint(my_heap_t* heap, size_t size, int hints){
+	return allocate_object(heap, size, my_get_thread_tag(), hints);
+}
+
+/*
+ * Frees an object of any kind.
+ */
+void free_object(my_heap_t* heap, void* ptr){
+	if(ALLOCATION_KIND(ptr) == KIND_BUMP){
+		/* The last free of a retired or parked chunk's objects releases the chunk */
+		bump_header* object = (bump_header*) ((char*) ptr - sizeof(bump_header));
+		chunk_header* chunk = (chunk_header*) ((char*) object - object->chunk_offset);
+		long balance;
+		account_tag(heap, object->tag, object->size, FALSE);
+		balance = __sync_sub_and_fetch(&chunk->balance, 1);
+		if(balance == 0) free_block(heap, (block_header*) chunk - 1);
+		else if(balance == ORPHAN_BIAS) release_orphan_chunk(heap, chunk);
+		return;
+	}
+	if(ALLOCATION_KIND(ptr) == KIND_HUGE){
+		free_huge(heap, (huge_header*) ptr - 1);
+		return;
+	}
+	assert(ALLOCATION_KIND(ptr) == KIND_BLOCK);
+	free_block(heap, (block_header*) ((char*) ptr - sizeof(block_header)));
+}
+
+void my_heap_free(my_heap_t* heap, void* ptr){
+	struct timespec start;
+	if (ptr == NULL) return;
+	assert(heap != NULL);
+	if(heap->stats_path == NULL){
+		free_object(heap, ptr);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	free_object(heap, ptr);
+	record_latency(heap->free_latency, &heap->free_latency_ns, &start);
+}
+
+/*
+ * Returns the number of payload bytes usable at ptr and stores the allocation's tag.
+ */
+size_t allocation_size(void* ptr, int* tag){
+	if(ALLOCATION_KIND(ptr) == KIND_BUMP){
+		bump_header* object = (bump_header*) ((char*) ptr - sizeof(bump_header));
+		*tag = object->tag;
+		return object->size - sizeof(bump_header);
+	}
+	if(ALLOCATION_KIND(ptr) == KIND_HUGE){
+		huge_header* huge = (huge_header*) ptr - 1;
+		*tag = huge->tag;
+		return huge->mapping_size - sizeof(huge_header);
+	}
+	assert(ALLOCATION_KIND(ptr) == KIND_BLOCK);
+	*tag = ((block_header*) ptr - 1)->tag;
+	return ((block_header*) ptr - 1)->size;
+}
+
+size_t my_malloc_usable_size(void* ptr){
+	int tag;
+	if(ptr == NULL) return 0;
+	return allocation_size(ptr, &tag);
+}
+
+size_t my_heap_good_size(my_heap_t* heap, size_t size){
+	heap_meta* meta;
+	segment* seg;
+	assert(heap != NULL);
+	meta = heap->meta;
+	if(size == 0) return 0;
+	if(meta->huge_size > 0 && size > meta->huge_size) return ALIGN_UP(size + sizeof(huge_header), PAGE_SIZE) - sizeof(huge_header);
+	if(size <= meta->bump_max_size) return ALIGN_UP(size, ALIGNMENT);
+	/* Follow the rounding of allocate_object() and the tier routing of allocate_block() */
+	size = ALIGN_UP(round_to_size_class(&meta->tuning, size), ALIGNMENT);
+	if(size > meta->tuning.large_size) seg = heap->segments + LARGE_SEGMENT(meta);
+	else if(meta->num_medium_segments > 0 && size > meta->tuning.medium_size) seg = heap->segments + meta->num_small_segments;
+	else seg = heap->segments;
+	/* Buddy blocks end on a page boundary; the pages beyond the request are freed again */
+	if(seg->policy == MY_HEAP_POLICY_BUDDY) size = ALIGN_UP(size + sizeof(block_header), BUDDY_MIN_BLOCK) - sizeof(block_header);
+	return size;
+}
+
+size_t my_malloc_good_size(size_t size){
+	my_heap_t* heap;
+	heap = my_heap_default();
+	if(heap == NULL) return size;
+	return my_heap_good_size(heap, size);
+}
+
+void* my_heap_realloc(my_heap_t* heap, void* ptr, size_t size){
+	void* new_ptr;
+	size_t old_size;
+	int tag;
+	assert(heap != NULL);
+	if(ptr == NULL) return my_heap_malloc(heap, size);
+	if(size == 0){
+		my_heap_free(heap, ptr);
+		return NULL;
+	}
+	/* Huge blocks stay in their mapping, which moves pages rather than bytes */
+	if(ALLOCATION_KIND(ptr) == KIND_HUGE){
+		huge_header* huge = resize_huge(heap, (huge_header*) ptr - 1, size);
+		return huge != NULL ? (void*) (huge + 1) : NULL;
+	}
+	old_size = allocation_size(ptr, &tag);
+	if(size <= old_size) return ptr;
+	new_ptr = allocate_object(heap, size, tag, 0);
+	if(new_ptr == NULL) return NULL;
+	memcpy(new_ptr, ptr, old_size);
+	my_heap_free(heap, ptr);
+	return new_ptr;
+}
+
+/*
+ * Starts a new scope chunk that can hold at least bytes bytes on a thread's scope stack, reusing
+ * the spare chunk if it is large enough. Returns FALSE if no chunk could be allocated.
+ */
+bool push_scope_chunk(my_heap_t* heap, thread_state* state, size_t bytes){
+	scope_chunk* chunk = state->scope_spare;
+	size_t chunk_size = ALIGN_UP(heap->meta->scope_chunk_size, ALIGNMENT);
+	if(chunk_size < sizeof(scope_chunk) + bytes) chunk_size = sizeof(scope_chunk) + bytes;
+	if(chunk != NULL && (size_t) (chunk->end - (char*) chunk) >= chunk_size){
+		state->scope_spare = NULL;
+	}else{
+		block_header* block = allocate_block(heap, chunk_size, chunk_size, MY_HEAP_NO_TAG, state->home_segment, BLOCK_CHUNK);
+		if(block == NULL) return FALSE;
+		chunk = (scope_chunk*) ((char*) block + sizeof(block_header));
+		chunk->end = (char*) chunk + block->size;
+	}
+	chunk->prev = state->scope_chunk;
+	state->scope_chunk = chunk;
+	state->scope_top = (char*) chunk + sizeof(scope_chunk);
+	state->scope_end = chunk->end;
+	return TRUE;
+}
+
+/*
+ * Gives up a scope chunk that no scope uses anymore: it becomes the thread's spare chunk if there
+ * is none yet and it has the default size, otherwise it goes back to its segment.
+ */
+void drop_scope_chunk(my_heap_t* heap, thread_state* state, scope_chunk* chunk){
+	if(state->scope_spare == NULL && (size_t) (chunk->end - (char*) chunk) == ALIGN_UP(heap->meta->scope_chunk_size, ALIGNMENT)){
+		state->scope_spare = chunk;
+		return;
+	}
+	free_block(heap, (block_header*) chunk - 1);
+}
+
+/*
+ * Returns all scope chunks of an exiting thread, including the spare one, to their segments.
+ */
+void release_scope_chunks(my_heap_t* heap, thread_state* state){
+	while(state->scope_chunk != NULL){
+		scope_chunk* chunk = state->scope_chunk;
+		state->scope_chunk = chunk->prev;
+		free_block(heap, (block_header*) chunk - 1);
+	}
+	if(state->scope_spare != NULL) free_block(heap, (block_header*) state->scope_spare - 1);
+	state->scope_spare = NULL;
+	state->scope_top = NULL;
+	state->scope_end = NULL;
+	state->scope_frame = NULL;
+}
+
+/*
+ * Bump allocates bytes bytes (a multiple of ALIGNMENT) from a thread's scope stack.
+ * Returns NULL if the stack has no room and no chunk could be added.
+ */
+void* scope_push(my_heap_t* heap, thread_state* state, size_t bytes){
+	void* ptr;
+	if((size_t) (state->scope_end - state->scope_top) < bytes && !push_scope_chunk(heap, state, bytes)) return NULL;
+	ptr = (void*) state->scope_top;
+	state->scope_top += bytes;
+	return ptr;
+}
+
+int my_heap_scope_begin(my_heap_t* heap){
+	thread_state* state;
+	scope_frame* frame;
+	scope_chunk* chunk;
+	char* top;
+	assert(heap != NULL);
+	state = get_thread_state(heap);
+	if(state == NULL) return -1;
+	chunk = state->scope_chunk;
+	top = state->scope_top;
+	frame = (scope_frame*) scope_push(heap, state, ALIGN_UP(sizeof(scope_frame), ALIGNMENT));
+	if(frame == NULL) return -1;
+	frame->prev = state->scope_frame;
+	frame->chunk = chunk;
+	frame->top = top;
+	state->scope_frame = frame;
+	return 0;
+}
+
+void* my_heap_scope_malloc(my_heap_t* heap, size_t size){
+	thread_state* state;
+	assert(heap != NULL);
+	assert(size > 0);
+	if(!heap->has_thread_key) return NULL;
+	state = (thread_state*) pthread_getspecific(heap->thread_key);
+	if(state == NULL || state->scope_frame == NULL) return NULL;
+	return scope_push(heap, state, ALIGN_UP(size, ALIGNMENT));
+}
+
+void my_heap_scope_end(my_heap_t* heap){
+	thread_state* state;
+	scope_frame* frame;
+	assert(heap != NULL);
+	if(!heap->has_thread_key) return;
+	state = (thread_state*) pthread_getspecific(heap->thread_key);
+	if(state == NULL || state->scope_frame == NULL) return;
+	frame = state->scope_frame;
+	state->scope_frame = frame->prev;
+	/* Pop the chunks started inside the scope, then rewind to where the stack stood before it */
+	while(state->scope_chunk != frame->chunk){
+		scope_chunk* chunk = state->scope_chunk;
+		state->scope_chunk = chunk->prev;
+		drop_scope_chunk(heap, state, chunk);
+	}
+	state->scope_top = frame->top;
+	state->scope_end = state->scope_chunk != NULL ? state->scope_chunk->end : NULL;
+}
+
+/*
+ * Returns the chunks and scope stacks of this process's threads to the heap and unmaps its base
+ * memory. If this process created the heap, also destroys all segment mutexes and condition
+ * variables and removes the shared memory object name.
+ */
+void my_heap_destroy(my_heap_t* heap){
+	thread_state* state;
+	int i;
+	if(heap == NULL) return;
+	stop_maintenance(heap);
+	unregister_heap(heap);
+	/* Chunks still held by this process's threads go back to their segments, which outlive the
+	 * process in a shared or persistent heap */
+	for(state = heap->thread_states; state != NULL; state = state->next_state){
+		retire_chunk(heap, state);
+		release_scope_chunks(heap, state);
+		flush_tag_deltas(heap, state);
+	}
+	if(heap->owner){
+		for(i = 0; i < heap->meta->num_segments; i++){
+			pthread_mutex_destroy(&((heap->segments + i)->lock));
+			pthread_cond_destroy(&((heap->segments + i)->condition));
+		}
+		if(heap->shm_name != NULL) shm_unlink(heap->shm_name);
+		/* Persistent heaps are flushed and marked clean so the next open needs no recovery */
+		if(heap->meta->flags & MY_HEAP_PERSISTENT){
+			msync(heap->base_ptr, heap->mapping_size, MS_SYNC);
+			heap->meta->clean = TRUE;
+			msync(heap->base_ptr, PAGE_SIZE, MS_SYNC);
+		}
+	}
+	release_heap_handle(heap);
+}
+
+my_heap_t* my_heap_default(){
+	my_heap_t* heap;
+	/* Ensure initialization only happens once by locking the mutex */
+	pthread_mutex_lock(&default_heap_mutex);
+	if(default_heap == NULL){
+		/* Initialize the allocator */
+		default_heap = my_heap_create(NULL);
+	}
+	heap = default_heap;
+	pthread_mutex_unlock(&default_heap_mutex);
+	return heap;
+}
+
+void my_prefault(size_t bytes){
+	my_heap_t* heap;
+	heap = my_heap_default();
+	if(heap != NULL) my_heap_prefault(heap, bytes);
+}
+
+void* my_malloc(size_t size){
+	my_heap_t* heap;
+	assert(size > 0);
+	heap = my_heap_default();
+	if(heap == NULL) return NULL;
+	return my_heap_malloc(heap, size);
+}
+
+void* my_malloc_tagged(size_t size, int tag){
+	my_heap_t* heap;
+	assert(size > 0);
+	heap = my_heap_default();
+	if(heap == NULL) return NULL;
+	return my_heap_malloc_tagged(heap, size, tag);
+}
+
+void* my_malloc_hint(size_t size, int hints){
+	my_heap_t* heap;
+	assert(size > 0);
+	heap = my_heap_default();
+	if(heap == NULL) return NULL;
+	return my_heap_malloc_hint(heap, size, hints);
+}
+
+void* my_realloc(void* ptr, size_t size){
+	my_heap_t* heap;
+	heap = my_heap_default();
+	if(heap == NULL) return NULL;
+	return my_heap_realloc(heap, ptr, size);
+}
+
+int my_scope_begin(){
+	my_heap_t* heap = my_heap_default();
+	if(heap == NULL) return -1;
+	return my_heap_scope_begin(heap);
+}
+
+void* my_scope_malloc(size_t size){
+	assert(size > 0);
+	if(default_heap == NULL) return NULL;
+	return my_heap_scope_malloc(default_heap, size);
+}
+
+void my_scope_end(){
+	if(default_heap == NULL) return;
+	my_heap_scope_end(default_heap);
+}
+
+void my_free(void* ptr){
+	if(ptr == NULL || default_heap == NULL) return;
+	my_heap_free(default_heap, ptr);
+}
+
+/*
+ * Destroys the default heap so that the next call to my_malloc() initializes a fresh one.
+ */
+void free_base_memory(){
+	pthread_mutex_lock(&default_heap_mutex);
+	my_heap_destroy(default_heap);
+	default_heap = NULL;
+	pthread_mutex_unlock(&default_heap_mutex);
 }
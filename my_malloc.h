@@ -12,14 +12,413 @@
  */
 void* my_malloc(size_t size);
 
+/* 
+ * Allocates a block of memory of the specified size on behalf of an allocation tag (tenant).
+ * The block is accounted to the tag and the allocation fails immediately if it would exceed the tag's quota.
+ * Returns a pointer to the allocated memory or NULL if allocation fails.
+ */
+void* my_malloc_tagged(size_t size, int tag);
+
+/* 
+ * Faults in the pages of the default heap ahead of use; see my_heap_prefault().
+ */
+void my_prefault(size_t bytes);
+
+/* 
+ * Changes the size of a block allocated by my_malloc() to size bytes, keeping its contents up to the smaller size.
+ * Huge blocks (see huge_size) are resized with mremap(), in place when possible and without copying otherwise.
+ * A NULL ptr allocates and a size of 0 frees. Returns the block, which may have moved, or NULL if resizing
+ * fails, in which case the original block is left untouched.
+ */
+void* my_realloc(void* ptr, size_t size);
+
+/* 
+ * Returns the number of bytes that can be used at ptr, which is at least the size requested from my_malloc()
+ * and includes the slack of the block it was placed in (0 for NULL). Not valid for scope memory.
+ */
+size_t my_malloc_usable_size(void* ptr);
+
+/* 
+ * Returns the size a my_malloc() request of size bytes is rounded up to, so that callers can ask for the
+ * full block up front. my_malloc_usable_size() can be larger still when a block is not split.
+ */
+size_t my_malloc_good_size(size_t size);
+
+/* Lifetime hints for my_malloc_hint() and my_heap_malloc_hint() */
+/* Freed soon; placed like an unhinted allocation */
+#define MY_HEAP_HINT_SHORT_LIVED 0x1
+/* Kept much longer than the surrounding allocations; carved from the top of its segment */
+#define MY_HEAP_HINT_LONG_LIVED 0x2
+/* Never (or only at shutdown) freed; small objects are packed into a chunk of their own */
+#define MY_HEAP_HINT_IMMORTAL 0x4
+
+/* 
+ * Allocates a block of memory of the specified size, placed according to the lifetime hints (MY_HEAP_HINT_*),
+ * so that long-lived and immortal blocks are kept apart from short-lived ones and do not pin holes among them.
+ * Returns a pointer to the allocated memory or NULL if allocation fails.
+ */
+void* my_malloc_hint(size_t size, int hints);
+
 /* 
  * Frees a previously allocated block of memory.
  * Takes a pointer to the block to be freed.
  */
 void my_free(void* ptr);
 
+/* 
+ * Opens a scope on the calling thread. Memory from my_scope_malloc() lives until the matching my_scope_end().
+ * Scopes nest. Returns 0 on success or -1 if the scope could not be opened.
+ */
+int my_scope_begin();
+
+/* 
+ * Allocates memory of the specified size from the calling thread's innermost scope.
+ * The memory has no block header and must not be passed to my_free(); it is released by my_scope_end().
+ * Returns a pointer to the allocated memory or NULL if no scope is open or allocation fails.
+ */
+void* my_scope_malloc(size_t size);
+
+/* 
+ * Closes the calling thread's innermost scope and releases everything allocated in it at once.
+ */
+void my_scope_end();
+
 /* 
  * Frees pre-allocated memory.
  * This function should be called when the program is done using the memory.
  */
 void free_base_memory();
+
+/* Number of allocation tags; tag 0 (MY_HEAP_NO_TAG) is used for untagged allocations */
+#define MY_HEAP_MAX_TAGS 64
+#define MY_HEAP_NO_TAG 0
+
+/* 
+ * Sets the allocation tag used by my_malloc() and my_heap_malloc() on the calling thread.
+ */
+void my_set_thread_tag(int tag);
+
+/* 
+ * Returns the allocation tag of the calling thread (MY_HEAP_NO_TAG unless set).
+ */
+int my_get_thread_tag();
+
+/* Opaque handle to an independent heap instance with its own base memory, segments and locks. */
+typedef struct my_heap my_heap_t;
+
+/* Heap flags */
+/* Places the heap in a shared memory mapping that other processes can attach to */
+#define MY_HEAP_SHARED 0x1
+/* Maps the heap from a file so that its allocations survive process restarts */
+#define MY_HEAP_PERSISTENT 0x2
+/* Bounds the time of every allocation and free: all segments use MY_HEAP_POLICY_TLSF, segment locks and the heap's
+ * other locks inherit priority, allocations fail instead of waiting for memory, and automatic tuning, huge blocks
+ * and maintenance passes are not used */
+#define MY_HEAP_REALTIME 0x4
+/* Faults in every page of the heap when it is created (see my_heap_prefault()) instead of on first use */
+#define MY_HEAP_PREFAULT 0x8
+/* Locks the heap's pages in memory with mlock(); creation fails if they cannot be locked (see RLIMIT_MEMLOCK) */
+#define MY_HEAP_LOCKED 0x10
+
+/* Flags for my_heap_reset() */
+/* Returns the physical pages of the dropped allocations to the operating system */
+#define MY_HEAP_RESET_RELEASE_PAGES 0x1
+
+/* Allocation policies of a segment */
+/* Unsorted free list of variable sized blocks, searched for the best fit and coalesced with boundary tags */
+#define MY_HEAP_POLICY_BEST_FIT 0
+/* Buddy system of power-of-two blocks with a free list and bitmap per order; unused tails are returned */
+#define MY_HEAP_POLICY_BUDDY 1
+/* Best fit through a red-black tree of the free blocks ordered by (size, address), found in O(log n) */
+#define MY_HEAP_POLICY_INDEXED 2
+/* The first block of the free list that fits */
+#define MY_HEAP_POLICY_FIRST_FIT 3
+/* The first block that fits after the one the previous search stopped at */
+#define MY_HEAP_POLICY_NEXT_FIT 4
+/* The first block at most good_fit_percent larger than the request, or else the best fit */
+#define MY_HEAP_POLICY_GOOD_FIT 5
+/* Two-level segregated fit: free lists per size range found through bitmaps in constant time */
+#define MY_HEAP_POLICY_TLSF 6
+
+/* How an allocation picks a segment within its tier */
+/* The segments take turns, shared by all threads */
+#define MY_HEAP_SELECT_ROUND_ROBIN 0
+/* The segment is chosen by the CPU the thread runs on, so only threads on the same CPU compete for it */
+#define MY_HEAP_SELECT_CPU 1
+
+/* Maximum number of size classes a heap rounds requests to */
+#define MY_HEAP_MAX_SIZE_CLASSES 32
+
+/* 
+ * Allocation parameters of a heap.
+ * Set when creating a heap, or derived from the observed request sizes by my_heap_tune().
+ */
+typedef struct my_heap_tuning{
+	/* Percentages of the heap given to the small and the medium segments, the rest goes to the large segment */
+	unsigned int small_percent;
+	unsigned int medium_percent;
+	/* Requests larger than medium_size (in bytes) are served by the medium segments (if medium_percent is not 0),
+	 * requests larger than large_size by the large segment */
+	size_t medium_size;
+	size_t large_size;
+	/* A free block is only split if the remainder can hold at least this many bytes */
+	size_t min_split_size;
+	/* Requests up to the largest size class are rounded up to the nearest class (ascending, multiples of 16 bytes) */
+	int num_size_classes;
+	size_t size_classes[MY_HEAP_MAX_SIZE_CLASSES];
+} my_heap_tuning_t;
+
+/* Configuration used when creating a heap with my_heap_create(). */
+typedef struct my_heap_config{
+	/* Total size (in bytes) of memory to be allocated for the heap */
+	size_t total_size;
+	/* Combination of the MY_HEAP_* flags above */
+	int flags;
+	/* Name of the POSIX shared memory object for MY_HEAP_SHARED heaps (e.g. "/my_heap"); NULL uses an anonymous memfd */
+	const char* shm_name;
+	/* Path of the backing file for MY_HEAP_PERSISTENT heaps */
+	const char* path;
+	/* Initial allocation parameters */
+	my_heap_tuning_t tuning;
+	/* Retune the heap automatically about every tune_interval allocations (at least one per small segment);
+	 * 0 only tunes on request */
+	unsigned long tune_interval;
+	/* Pressure callbacks fire when the bytes in use of the heap rise to high_watermark and fall back to low_watermark (0 disables) */
+	size_t high_watermark;
+	size_t low_watermark;
+	/* The same for each segment, as a percentage of the segment size (0 disables) */
+	unsigned int segment_high_percent;
+	unsigned int segment_low_percent;
+	/* Requests up to bump_max_size bytes are bump allocated from per-thread chunks of bump_chunk_size bytes (0 disables; always off for persistent heaps) */
+	size_t bump_max_size;
+	size_t bump_chunk_size;
+	/* Size of the chunks that hold the per-thread stacks of my_heap_scope_malloc() (larger requests get a chunk of their own) */
+	size_t scope_chunk_size;
+	/* Requests larger than huge_size bytes get a private mapping of their own, which my_heap_realloc() grows
+	 * with mremap() instead of copying (0 disables; always off for shared and persistent heaps) */
+	size_t huge_size;
+	/* Segment selection within a tier (MY_HEAP_SELECT_*) */
+	int segment_selection;
+	/* Number of small segments (at most 64); 0 gives 4, or one per configured CPU with MY_HEAP_SELECT_CPU */
+	int num_small_segments;
+	/* Allocation policies (MY_HEAP_POLICY_*) of the small segments (any but buddy), the medium segments and the large segment */
+	int small_policy;
+	int medium_policy;
+	int large_policy;
+	/* Tolerance of MY_HEAP_POLICY_GOOD_FIT in percent of the request */
+	unsigned int good_fit_percent;
+	/* A small segment that runs out of room borrows a region of at least loan_size bytes from the large segment,
+	 * which is given back once it is empty again (0 disables) */
+	size_t loan_size;
+	/* A background thread wakes up every maintenance_interval milliseconds to release the pages of segments that
+	 * have been idle since its previous pass and to carry out automatic retuning off the allocation path (0 disables;
+	 * ignored for MY_HEAP_REALTIME heaps) */
+	unsigned long maintenance_interval;
+	/* Every stats_interval milliseconds the same thread writes the heap's statistics to stats_path in the Prometheus
+	 * text format (see my_heap_write_stats(); NULL disables). Allocations and frees are timed only while exporting. */
+	const char* stats_path;
+	unsigned long stats_interval;
+} my_heap_config_t;
+
+/* Pressure levels reported to pressure callbacks */
+/* Usage fell back to the low watermark */
+#define MY_HEAP_PRESSURE_LOW 0
+/* Usage rose to the high watermark */
+#define MY_HEAP_PRESSURE_HIGH 1
+/* An allocation found no free block in its segment and is about to wait or fail */
+#define MY_HEAP_PRESSURE_CRITICAL 2
+
+/* 
+ * Called when the usage of a heap (segment_id -1) or of one of its segments crosses a watermark.
+ * Runs on the allocating or freeing thread without allocator locks held, so it may free memory from the heap.
+ */
+typedef void (*my_heap_pressure_callback_t)(my_heap_t* heap, int level, int segment_id, size_t bytes_in_use, size_t capacity, void* arg);
+
+/* 
+ * Returns a configuration filled with the default values used by my_malloc().
+ */
+my_heap_config_t my_heap_config_default();
+
+/* 
+ * Creates a new heap and pre-allocates its memory.
+ * Takes a pointer to the configuration or NULL to use the defaults.
+ * For MY_HEAP_PERSISTENT heaps, an existing heap file at config->path is reopened with all of its
+ * allocations intact (total_size is then taken from the file) and a missing or empty file is initialized.
+ * A heap file can only be open once at a time; opening it again (in any process) fails with errno EWOULDBLOCK.
+ * Returns the new heap or NULL if creation fails.
+ */
+my_heap_t* my_heap_create(const my_heap_config_t* config);
+
+/* 
+ * Returns the default heap used by my_malloc(), creating it if necessary, or NULL if it cannot be created.
+ */
+my_heap_t* my_heap_default();
+
+/* 
+ * Allocates a block of memory of the specified size from the given heap.
+ * Returns a pointer to the allocated memory or NULL if allocation fails.
+ */
+void* my_heap_malloc(my_heap_t* heap, size_t size);
+
+/* 
+ * Allocates a block of memory from the given heap on behalf of an allocation tag.
+ * Fails immediately (returns NULL) if the allocation would exceed the tag's quota.
+ */
+void* my_heap_malloc_tagged(my_heap_t* heap, size_t size, int tag);
+
+/* 
+ * Allocates a block of memory from the given heap, placed according to the lifetime hints (MY_HEAP_HINT_*).
+ */
+void* my_heap_malloc_hint(my_heap_t* heap, size_t size, int hints);
+
+/* 
+ * Changes the size of a block allocated from the given heap; see my_realloc().
+ */
+void* my_heap_realloc(my_heap_t* heap, void* ptr, size_t size);
+
+/* 
+ * Returns the size a request of size bytes from the given heap is rounded up to; see my_malloc_good_size().
+ */
+size_t my_heap_good_size(my_heap_t* heap, size_t size);
+
+/* 
+ * Scopes on a specific heap; see my_scope_begin(), my_scope_malloc() and my_scope_end().
+ */
+int my_heap_scope_begin(my_heap_t* heap);
+void* my_heap_scope_malloc(my_heap_t* heap, size_t size);
+void my_heap_scope_end(my_heap_t* heap);
+
+/* 
+ * Frees a block of memory previously allocated from the given heap.
+ */
+void my_heap_free(my_heap_t* heap, void* ptr);
+
+/* 
+ * Destroys a heap and frees its pre-allocated memory.
+ * All memory allocated from the heap becomes invalid.
+ * For a heap obtained through my_heap_attach() or my_heap_attach_fd(), only unmaps it from this process.
+ * The process that created a shared heap must destroy it last.
+ * MY_HEAP_PERSISTENT heaps are flushed to their backing file, which is kept for the next my_heap_create().
+ */
+void my_heap_destroy(my_heap_t* heap);
+
+/* 
+ * Drops every allocation of a heap at once and makes all of its memory available again without unmapping it.
+ * Each segment is re-formed as a single free block, which takes constant time per segment.
+ * Takes a combination of the MY_HEAP_RESET_* flags; MY_HEAP_RESET_RELEASE_PAGES additionally returns the pages to the operating system.
+ * All memory allocated from the heap before the reset becomes invalid and must not be freed.
+ */
+void my_heap_reset(my_heap_t* heap, int flags);
+
+/* 
+ * Attaches to a MY_HEAP_SHARED heap created by another process under the given shared memory name.
+ * Returns the heap or NULL if no valid heap exists under that name.
+ */
+my_heap_t* my_heap_attach(const char* shm_name);
+
+/* 
+ * Attaches to a MY_HEAP_SHARED heap through a file descriptor received from another process (e.g. a memfd).
+ * On success the heap takes ownership of the file descriptor.
+ * Returns the heap or NULL if the descriptor does not refer to a valid heap.
+ */
+my_heap_t* my_heap_attach_fd(int fd);
+
+/* 
+ * Returns the file descriptor backing a MY_HEAP_SHARED heap so it can be passed to other processes, or -1.
+ */
+int my_heap_fd(my_heap_t* heap);
+
+/* 
+ * Converts a pointer allocated from the heap to an offset that is valid in every process attached to it.
+ */
+size_t my_heap_ptr_to_offset(my_heap_t* heap, void* ptr);
+
+/* 
+ * Converts an offset produced by my_heap_ptr_to_offset() back to a pointer in this process.
+ */
+void* my_heap_offset_to_ptr(my_heap_t* heap, size_t offset);
+
+/* 
+ * Stores the root object of a heap, from which the application finds its data after reopening a persistent heap.
+ */
+void my_heap_set_root(my_heap_t* heap, void* ptr);
+
+/* 
+ * Returns the root object stored by my_heap_set_root() or NULL if none has been set.
+ */
+void* my_heap_get_root(my_heap_t* heap);
+
+/* 
+ * Returns non-zero if a reopened persistent heap could not be mapped at its previous address.
+ * Raw pointers stored inside the heap are then invalid and only offsets can be used.
+ */
+int my_heap_is_relocated(my_heap_t* heap);
+
+/* 
+ * Faults in the pages of a heap ahead of use, so that allocations do not take page faults later.
+ * Each segment is prefaulted from its start up to its share of bytes (0 prefaults the whole heap).
+ * The segments are spread over one thread per online CPU. Contents of allocated blocks are not changed.
+ */
+void my_heap_prefault(my_heap_t* heap, size_t bytes);
+
+/* 
+ * Writes the statistics of a heap to path in the Prometheus text exposition format: per-segment capacity, usage,
+ * largest free block, lock acquisitions and contention, waits and wait timeouts, and histograms of the allocation
+ * and free latencies of this process. The file is replaced atomically, as the node exporter's textfile collector expects.
+ * Returns 0 on success or -1 on failure.
+ */
+int my_heap_write_stats(my_heap_t* heap, const char* path);
+
+/* 
+ * Flushes a file-backed heap to its backing file.
+ * Returns 0 on success or -1 on failure.
+ */
+int my_heap_sync(my_heap_t* heap);
+
+/* 
+ * Derives new allocation parameters from the histogram of request sizes observed so far and applies them.
+ * Size classes are chosen to minimize the bytes wasted by rounding, the minimum split size follows the
+ * smallest class and the large allocation threshold moves to the largest 1% of requests.
+ * The segment split cannot change for an existing heap; pass the result of my_heap_get_tuning() to new heaps instead.
+ * Older requests lose weight every time the heap is tuned.
+ * Returns 0 on success or -1 if too few requests have been observed.
+ */
+int my_heap_tune(my_heap_t* heap);
+
+/* 
+ * Copies the allocation parameters currently in effect for the heap.
+ */
+void my_heap_get_tuning(my_heap_t* heap, my_heap_tuning_t* tuning);
+
+/* 
+ * Registers a callback (with an argument passed back to it) for the heap's pressure events.
+ * Callbacks are local to the registering process.
+ * Returns 0 on success or -1 if too many callbacks are registered.
+ */
+int my_heap_add_pressure_callback(my_heap_t* heap, my_heap_pressure_callback_t callback, void* arg);
+
+/* 
+ * Unregisters a callback previously registered with the same argument.
+ */
+void my_heap_remove_pressure_callback(my_heap_t* heap, my_heap_pressure_callback_t callback, void* arg);
+
+/* 
+ * Changes the heap watermarks (in bytes) and the segment watermarks (in percent of each segment); 0 disables them.
+ */
+void my_heap_set_watermarks(my_heap_t* heap, size_t high_watermark, size_t low_watermark, unsigned int segment_high_percent, unsigned int segment_low_percent);
+
+/* 
+ * Returns the number of bytes (including block headers) currently allocated from the heap.
+ */
+size_t my_heap_bytes_in_use(my_heap_t* heap);
+
+/* 
+ * Sets the maximum number of bytes (including block headers) a tag may hold in the heap; 0 means unlimited.
+ * Usage is collected per thread and published in batches, so the quota may be exceeded by up to 64 KiB per thread.
+ */
+void my_heap_set_tag_quota(my_heap_t* heap, int tag, size_t quota);
+
+/* 
+ * Returns the number of bytes (including block headers) currently held by a tag in the heap.
+ */
+size_t my_heap_tag_usage(my_heap_t* heap, int tag);
@@ -0,0 +1,361 @@
+#ifndef MY_MALLOC_INTERNAL_H
+#define MY_MALLOC_INTERNAL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "my_malloc.h"
+
+/* NOTE: Layout of the heap and the free list primitives shared by my_malloc.c and the micro-benchmarks in bench.c.
+ * Applications only use my_malloc.h. */
+
+/* Boolean definitions */
+#define TRUE 1
+#define FALSE 0
+typedef unsigned char bool;
+
+/* Number of segments: small segments first, then the optional medium segments, then the large segment */
+#define NUM_SMALL_SEGMENTS 4
+#define MAX_SMALL_SEGMENTS 64
+#define NUM_MEDIUM_SEGMENTS 2
+#define MAX_SEGMENTS (MAX_SMALL_SEGMENTS + NUM_MEDIUM_SEGMENTS + 1)
+#define SMALL_SEGMENT_SIZE(total, small_percent, num_small) (((total) * (double) ((small_percent)/100.0)) / (double) (num_small))
+#define MEDIUM_SEGMENT_SIZE(total, medium_percent) (((total) * (double) ((medium_percent)/100.0)) / (double) NUM_MEDIUM_SEGMENTS)
+#define LARGE_SEGMENT_SIZE(total, small_percent, medium_percent) (((total) * (double) ((100 - (small_percent) - (medium_percent))/100.0)))
+#define LARGE_SEGMENT(meta) ((meta)->num_segments - 1)
+
+/* Default percentages of the heap used by the small and the medium segments */
+#define SMALL_PERCENT 20
+#define MEDIUM_PERCENT 30
+
+/* Default size in bytes above which requests go to the medium segments */
+#define MEDIUM_SIZE 65536
+
+/* Default minimum split size in bytes */
+#define MIN_SPLIT_SIZE 32
+
+/* Maximum time in seconds to wait for large allocations */
+#define MAX_WAIT_TIME 0.1
+/* Default size above which allocations go to the large segment */
+#define LARGE_SIZE 4194304
+
+/*
+ * Request size histogram used to tune the heap. Buckets are logarithmic with
+ * HISTOGRAM_SUB_BUCKETS linear steps per power of two, starting at ALIGNMENT bytes.
+ */
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_BUCKETS (30 * HISTOGRAM_SUB_BUCKETS)
+/* Minimum number of recorded requests before my_heap_tune() derives new parameters */
+#define MIN_TUNE_SAMPLES 1000
+
+/* A thread publishes its tag accounting once its unpublished bytes reach this amount */
+#define TAG_FLUSH_BYTES 65536
+
+/* Maximum number of pressure callbacks per heap */
+#define MAX_PRESSURE_CALLBACKS 8
+/* Pressure level of an event that did not happen */
+#define NO_PRESSURE_EVENT -1
+
+/* Alignment (in bytes) of every block header and payload */
+#define ALIGNMENT 16
+#define ALIGN_UP(n, a) (((n) + ((a) - 1)) & ~((size_t) (a) - 1))
+#define ALIGN_DOWN(n, a) ((n) & ~((size_t) (a) - 1))
+
+/* Segment data is page aligned so that whole pages can be shared or released */
+#define PAGE_SIZE 4096
+
+/* Identifies a mapping that holds an initialized heap */
+#define HEAP_MAGIC 0x4d59484541500001UL
+
+/* Smallest buddy block (a page) and maximum number of buddy orders */
+#define BUDDY_MIN_SHIFT 12
+#define BUDDY_MIN_BLOCK ((size_t) 1 << BUDDY_MIN_SHIFT)
+#define BUDDY_MAX_ORDERS 40
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* Two-level segregated fit: each power of two size range is split into TLSF_SL_COUNT lists,
+ * sizes below 1 << TLSF_LINEAR_SHIFT get one list per ALIGNMENT step */
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_LINEAR_SHIFT 8
+#define TLSF_FL_COUNT 32
+
+/* Block flags */
+#define BLOCK_FIRST 0x1
+#define BLOCK_FENCE 0x2
+/* The block is a thread chunk; its objects are accounted individually */
+#define BLOCK_CHUNK 0x4
+/* First block of a region borrowed from the large segment */
+#define BLOCK_BORROWED 0x8
+/* The block was allocated for a long-lived (or immortal) object and carved from the top of free space */
+#define BLOCK_LONG_LIVED 0x10
+
+/* Allocation and free latencies are counted in power of two buckets from 1 << LATENCY_MIN_SHIFT nanoseconds up */
+#define LATENCY_MIN_SHIFT 6
+#define LATENCY_BUCKETS 21
+
+/* Default interval of the statistics export in milliseconds */
+#define STATS_INTERVAL 10000
+
+/* Default tolerance of the good fit policy in percent */
+#define GOOD_FIT_PERCENT 25
+
+/* Default minimum size of a region lent by the large segment to a small segment */
+#define LOAN_SIZE 1048576
+
+/* Default largest request served from thread chunks and default chunk size */
+#define BUMP_MAX_SIZE 512
+#define BUMP_CHUNK_SIZE 65536
+
+/* Default size of the chunks holding thread scope stacks */
+#define SCOPE_CHUNK_SIZE 65536
+
+/* Default size in bytes above which requests get a private mapping */
+#define HUGE_SIZE 16777216
+
+/* Maximum number of chunks of exited threads parked for adoption per heap and process */
+#define MAX_ORPHAN_CHUNKS 64
+#define ORPHAN_BIAS (LONG_MAX / 2)
+
+/*
+ * Offsets are relative to the start of the heap mapping, so the same heap can be mapped
+ * at different addresses by different processes. Offset 0 holds the heap metadata and is
+ * never a valid block, so it is used as the NULL offset.
+ */
+typedef size_t heap_offset;
+#define NULL_OFFSET 0
+#define OFFSET_TO_PTR(base, off) ((off) == NULL_OFFSET ? NULL : (void*) ((char*) (base) + (off)))
+#define PTR_TO_OFFSET(base, ptr) ((ptr) == NULL ? NULL_OFFSET : (heap_offset) ((char*) (ptr) - (char*) (base)))
+
+/*
+ * Every allocation is preceded by a header whose last byte is its kind, so my_heap_free()
+ * can tell how a pointer was allocated by looking at the byte right before it.
+ */
+#define KIND_BLOCK 0x5b
+#define KIND_BUMP 0x6c
+#define KIND_HUGE 0x7d
+#define ALLOCATION_KIND(ptr) (*((unsigned char*) (ptr) - 1))
+
+/*
+ * The following structure is used to manage memory blocks.
+ * It contains the payload size of the block and of its physical predecessor,
+ * offsets of the next and previous blocks in the free list,
+ * and a flag indicating whether the block is free or not.
+ * Its size is a multiple of ALIGNMENT so that payloads stay aligned.
+ */
+typedef struct block_header{
+	size_t size;
+	size_t prev_size;
+	heap_offset next;
+	heap_offset prev;
+	size_t requested_size;
+	unsigned short segment_id;
+	unsigned short tag;
+	unsigned char flags;
+	bool free;
+	unsigned char reserved;
+	unsigned char kind;
+} block_header;
+
+/* Address of the block physically following/preceding a block */
+#define NEXT_BLOCK(block) ((block_header*) ((char*) (block) + sizeof(block_header) + (block)->size))
+#define PREV_BLOCK(block) ((block_header*) ((char*) (block) - (block)->prev_size - sizeof(block_header)))
+
+/*
+ * A thread chunk is the payload of an allocated block, carved from the owning thread's home segment.
+ * The owner bump-allocates objects from it without locking and counts them privately. Frees
+ * (from any thread) decrement balance atomically; when the owner retires the chunk it adds its
+ * count, so whoever brings balance back to zero after retirement releases the chunk.
+ */
+typedef struct chunk_header{
+	long balance;
+	size_t size;
+} chunk_header;
+
+/*
+ * The unused rest of an exited thread's chunk, parked in the heap's orphan pool until another
+ * thread adopts it. The exited owner's count is added to the balance together with ORPHAN_BIAS,
+ * so the free that brings the balance down to ORPHAN_BIAS knows the parked chunk is empty.
+ * The record itself lives at the chunk's bump pointer, in space that no object uses yet.
+ */
+typedef struct orphan_chunk{
+	chunk_header* chunk;
+	struct orphan_chunk* next;
+} orphan_chunk;
+
+/*
+ * The following structure starts the private mapping of a huge block, which lives outside the
+ * heap's mapping so that it can grow with mremap(). Huge blocks are linked per heap handle.
+ */
+typedef struct huge_header{
+	struct huge_header* next;
+	struct huge_header* prev;
+	size_t mapping_size;
+	size_t requested_size;
+	unsigned short tag;
+	unsigned char reserved[13];
+	unsigned char kind;
+} huge_header;
+
+/*
+ * A scope chunk is the payload of an allocated block that holds a thread's scope stack.
+ * Scope objects are bump allocated from the chunks without any header and are only
+ * released together when their scope ends; the chunks of a thread are linked newest first.
+ */
+typedef struct scope_chunk{
+	struct scope_chunk* prev;
+	char* end;
+} scope_chunk;
+
+/*
+ * Pushed onto the scope stack by my_heap_scope_begin(): where the stack stood before the scope.
+ */
+typedef struct scope_frame{
+	struct scope_frame* prev;
+	scope_chunk* chunk;
+	char* top;
+} scope_frame;
+
+/*
+ * The following structure precedes every object allocated from a thread chunk.
+ * It holds the object's size and tag and the distance back to its chunk.
+ */
+typedef struct bump_header{
+	unsigned int size;
+	unsigned int chunk_offset;
+	unsigned short tag;
+	unsigned char reserved[5];
+	unsigned char kind;
+} bump_header;
+
+/*
+ * The following structure represents a memory segment.
+ * It contains the size of the segment, the offset of the start of the segment,
+ * the offset of the free list of blocks, and mutex locks/conditions for thread safety.
+ * Segments live inside the heap mapping so that they can be shared between processes.
+ */
+typedef struct segment{
+	size_t size;
+	heap_offset start;
+	heap_offset free_list;
+	pthread_mutex_t lock;
+	pthread_cond_t condition;
+	/* Histogram of requests first handled by this segment, updated under its lock */
+	unsigned long histogram_count[HISTOGRAM_BUCKETS];
+	unsigned long histogram_bytes[HISTOGRAM_BUCKETS];
+	size_t histogram_max[HISTOGRAM_BUCKETS];
+	unsigned long allocations_since_tune;
+	/* Bytes (including headers) of the allocated blocks, updated under the segment lock */
+	size_t bytes_in_use;
+	bool under_pressure;
+	/* Regions borrowed from the large segment, linked through the headers of the lent blocks */
+	heap_offset loans;
+	/* Allocation policy (MY_HEAP_POLICY_*) */
+	int policy;
+	/* Next fit: free block the next search starts from */
+	heap_offset rover;
+	/* Buddy policy: page aligned region of buddy_size bytes after the bitmaps, with a free list and
+	 * a bitmap of free blocks per order (order k blocks are BUDDY_MIN_BLOCK << k bytes) */
+	heap_offset buddy_start;
+	size_t buddy_size;
+	int buddy_orders;
+	heap_offset buddy_free[BUDDY_MAX_ORDERS];
+	heap_offset buddy_bitmap[BUDDY_MAX_ORDERS];
+	/* TLSF policy: table of segregated free lists, reserved after the segments array */
+	heap_offset tlsf;
+	/* Allocations and frees so far; the maintenance thread purges a segment once after a pass without any */
+	unsigned long activity;
+	unsigned long maintained_activity;
+	bool purged;
+	/* Exported statistics, updated under the segment lock: lock acquisitions on the allocation and free paths
+	 * and how many of them found the lock taken, waits for a free block and how many of them timed out */
+	unsigned long lock_acquisitions;
+	unsigned long lock_contended;
+	unsigned long waits;
+	unsigned long wait_timeouts;
+} segment;
+
+/*
+ * Free lists of a TLSF segment. The bitmaps mark the non-empty lists, so that the list to
+ * allocate from is found with two bit scans whatever the number of free blocks.
+ */
+typedef struct tlsf_table{
+	unsigned int fl_bitmap;
+	unsigned int sl_bitmap[TLSF_FL_COUNT];
+	heap_offset heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} tlsf_table;
+
+/*
+ * The following structure is stored at the start of every heap mapping.
+ * It describes the layout of the mapping and is followed by the segment array.
+ */
+typedef struct heap_meta{
+	unsigned long magic;
+	size_t total_size;
+	int flags;
+	int num_segments;
+	int num_small_segments;
+	int num_medium_segments;
+	/* How allocations pick a segment within their tier (MY_HEAP_SELECT_*) */
+	int segment_selection;
+	heap_offset segments;
+	heap_offset data;
+	/* Persistent heaps: application root object, last mapping address and clean shutdown marker */
+	heap_offset root;
+	size_t base_address;
+	bool clean;
+	/* Allocation parameters in effect; read without locks and replaced by my_heap_tune() */
+	my_heap_tuning_t tuning;
+	unsigned long tune_interval;
+	/* Usage of the whole heap (updated atomically) and the watermarks that trigger pressure callbacks */
+	size_t capacity;
+	size_t bytes_in_use;
+	int under_pressure;
+	size_t high_watermark;
+	size_t low_watermark;
+	unsigned int segment_high_percent;
+	unsigned int segment_low_percent;
+	/* Published bytes in use and quota (0 = unlimited) per allocation tag */
+	size_t tag_bytes[MY_HEAP_MAX_TAGS];
+	size_t tag_quota[MY_HEAP_MAX_TAGS];
+	/* Requests up to bump_max_size bytes are served from thread chunks of bump_chunk_size bytes (0 disables) */
+	size_t bump_max_size;
+	size_t bump_chunk_size;
+	/* Size of the chunks that hold thread scope stacks */
+	size_t scope_chunk_size;
+	/* Requests larger than huge_size bytes get a private mapping of their own (0 disables; always off for shared heaps) */
+	size_t huge_size;
+	/* Minimum size of a region lent by the large segment to a small segment that ran out of room (0 disables) */
+	size_t loan_size;
+	/* Good fit accepts the first block at most this many percent larger than the request */
+	unsigned int good_fit_percent;
+} heap_meta;
+
+/* Free list primitives, timed in isolation by bench.c */
+
+/*
+ * Adds a block to the head of a free list and returns the offset of the new head.
+ */
+heap_offset add_to_free_list(char* base, heap_offset free_list, block_header* new_block);
+
+/*
+ * Unlinks a block from a free list, updating the head offset if the block is the head.
+ */
+void remove_from_free_list(char* base, heap_offset* free_list, block_header* block);
+
+/*
+ * Returns the smallest free block of a list that holds size bytes, or NULL.
+ */
+block_header* find_best_fit(char* base, heap_offset free_list, size_t size);
+
+/*
+ * Splits size bytes off the front of an unlinked free block if the remainder is large enough for a block
+ * of its own; the remainder goes to the segment's free list or tree. base must start with the heap_meta.
+ */
+void split_block(char* base, segment* seg, block_header* block, size_t size);
+
+/*
+ * Merges block2 into the physically preceding block1.
+ */
+void merge_blocks(block_header* block1, block_header* block2);
+
+#endif